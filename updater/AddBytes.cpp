@@ -0,0 +1,78 @@
+#include "Updater.h"
+
+#include "stdint.h"
+
+#ifdef PATCH_SIMD
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+//The add step of bspatch, kept apart so the test project can check every
+//version against the scalar one
+
+void add_bytes_scalar(uint8_t* dst, const uint8_t* src, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		dst[i] += src[i];
+}
+
+#ifdef PATCH_SIMD
+void add_bytes_sse2(uint8_t* dst, const uint8_t* src, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(a, b));
+	}
+
+	add_bytes_scalar(dst + i, src + i, len - i);
+}
+
+void add_bytes_avx2(uint8_t* dst, const uint8_t* src, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(a, b));
+	}
+
+	_mm256_zeroupper();
+
+	add_bytes_sse2(dst + i, src + i, len - i);
+}
+#endif
+
+add_bytes_t select_add_bytes()
+{
+#ifdef PATCH_SIMD
+	int info[4];
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	BOOL sse2 = (info[3] & (1 << 26)) != 0;
+	BOOL osxsave = (info[2] & (1 << 27)) != 0;
+	BOOL avx = (info[2] & (1 << 28)) != 0;
+
+	//AVX2 also needs the OS to save the YMM registers
+	if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return add_bytes_avx2;
+	}
+
+	if (sse2)
+		return add_bytes_sse2;
+#endif
+
+	return add_bytes_scalar;
+}
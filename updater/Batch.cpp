@@ -0,0 +1,303 @@
+#include "Updater.h"
+
+//Small files are asked for all at once: we POST the download hashes we want
+//and the server answers with one pack stream, so thousands of tiny files cost
+//one round trip instead of one each. The pack is, little endian:
+//	"OBSPAK01", then for each object: SHA-1, DWORD length, length bytes
+//Objects may come in any order and the server may leave out anything it
+//doesn't have; whatever we don't receive is downloaded the usual way.
+
+#define BATCH_PATH			_T("/update/getbatch")
+#define PACK_MAGIC			"OBSPAK01"
+
+#pragma pack(push, r1, 1)
+
+typedef struct
+{
+	BYTE		hash[20];
+	DWORD		length;
+} pack_entry_t;
+
+#pragma pack(pop, r1)
+
+typedef struct
+{
+	update_t	**items;
+	int			count;
+
+	BYTE		header[sizeof(pack_entry_t)];
+	DWORD		headerLength;
+	BOOL		gotMagic;
+
+	update_t	*current;
+	HANDLE		hFile;
+	hash_sink_t	sink;
+	DWORD		remaining;
+	LONG		currentBytes;
+
+	int			received;
+	LONGLONG	receivedBytes;
+} batch_stream_t;
+
+//Asked of the server the files come from, rather than a host of its own
+static BOOL GetBatchURL (const _TCHAR *sourceURL, _TCHAR *url, size_t size)
+{
+	URL_COMPONENTS urlComponents;
+	_TCHAR hostName[256];
+
+	ZeroMemory (&urlComponents, sizeof(urlComponents));
+
+	urlComponents.dwStructSize = sizeof(urlComponents);
+
+	urlComponents.lpszHostName = hostName;
+	urlComponents.dwHostNameLength = _countof(hostName);
+
+	if (!WinHttpCrackUrl(sourceURL, 0, 0, &urlComponents))
+		return FALSE;
+
+	StringCbPrintf(url, size, _T("%s://%s:%u%s"), urlComponents.nScheme == INTERNET_SCHEME_HTTPS ? _T("https") : _T("http"),
+		hostName, urlComponents.nPort, BATCH_PATH);
+
+	return TRUE;
+}
+
+static update_t *FindBatchItem (batch_stream_t *stream, const BYTE *hash)
+{
+	int low = 0;
+	int high = stream->count - 1;
+
+	while (low <= high)
+	{
+		int mid = (low + high) / 2;
+		int cmp = memcmp(stream->items[mid]->downloadhash, hash, 20);
+
+		if (!cmp)
+			return stream->items[mid];
+
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return NULL;
+}
+
+static VOID AbortBatchEntry (batch_stream_t *stream)
+{
+	if (!stream->current)
+		return;
+
+	HashSinkFree (&stream->sink);
+	CloseHandle (stream->hFile);
+	DeleteFile (stream->current->downloadPath);
+
+	InterlockedExchangeAdd (&completedFileSize, -stream->currentBytes);
+
+	stream->current->state = STATE_PENDING_DOWNLOAD;
+	stream->current = NULL;
+}
+
+static BOOL FinishBatchEntry (batch_stream_t *stream)
+{
+	update_t *update = stream->current;
+	BYTE downloadHash[20];
+
+	CloseHandle (stream->hFile);
+	stream->current = NULL;
+
+	if (!HashSinkFinish(&stream->sink, downloadHash) || memcmp(downloadHash, update->downloadhash, 20) || !PublishCachedDownload(update))
+	{
+		Log (_T("Batch download: %s failed its integrity check"), update->outputPath);
+
+		DeleteFile (update->downloadPath);
+		InterlockedExchangeAdd (&completedFileSize, -stream->currentBytes);
+		update->state = STATE_PENDING_DOWNLOAD;
+
+		return FALSE;
+	}
+
+	update->state = STATE_DOWNLOADED;
+	InterlockedIncrement (&completedUpdates);
+
+	//Their patches are queued with the rest once the batch is done
+	CompleteDuplicates (update);
+
+	stream->received++;
+	stream->receivedBytes += update->fileSize;
+
+	return TRUE;
+}
+
+static BOOL BeginBatchEntry (batch_stream_t *stream)
+{
+	pack_entry_t entry;
+
+	memcpy (&entry, stream->header, sizeof(entry));
+
+	//Something we didn't ask for, or asked for once and already got, means we've lost sync with the stream
+	update_t *update = FindBatchItem(stream, entry.hash);
+	if (!update || update->state != STATE_PENDING_DOWNLOAD || entry.length != update->fileSize)
+	{
+		Log (_T("Batch download: unexpected object in pack stream"));
+		return FALSE;
+	}
+
+	if (!HashSinkInit(&stream->sink))
+		return FALSE;
+
+	stream->hFile = CreateFile(update->downloadPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (stream->hFile == INVALID_HANDLE_VALUE)
+	{
+		HashSinkFree (&stream->sink);
+		return FALSE;
+	}
+
+	update->state = STATE_DOWNLOADING;
+
+	stream->current = update;
+	stream->remaining = entry.length;
+	stream->currentBytes = 0;
+
+	if (!stream->remaining)
+		return FinishBatchEntry(stream);
+
+	return TRUE;
+}
+
+static BOOL ReceiveBatchData (const BYTE *data, DWORD len, VOID *param)
+{
+	batch_stream_t *stream = (batch_stream_t *)param;
+
+	while (len)
+	{
+		if (!stream->current)
+		{
+			DWORD want = (stream->gotMagic ? sizeof(pack_entry_t) : sizeof(PACK_MAGIC) - 1) - stream->headerLength;
+			DWORD take = min(want, len);
+
+			memcpy (stream->header + stream->headerLength, data, take);
+			stream->headerLength += take;
+			data += take;
+			len -= take;
+
+			if (take < want)
+				break;
+
+			stream->headerLength = 0;
+
+			if (!stream->gotMagic)
+			{
+				if (memcmp(stream->header, PACK_MAGIC, sizeof(PACK_MAGIC) - 1))
+					return FALSE;
+
+				stream->gotMagic = TRUE;
+				continue;
+			}
+
+			if (!BeginBatchEntry(stream))
+				return FALSE;
+
+			continue;
+		}
+
+		DWORD take = min(stream->remaining, len);
+		DWORD wrote;
+
+		if (!WriteFile(stream->hFile, data, take, &wrote, NULL) || wrote != take || !HashSinkWrite(&stream->sink, data, take))
+			return FALSE;
+
+		InterlockedExchangeAdd (&completedFileSize, take);
+		stream->currentBytes += take;
+
+		stream->remaining -= take;
+		data += take;
+		len -= take;
+
+		if (!stream->remaining && !FinishBatchEntry(stream))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+VOID RunBatchDownload (update_t *updates)
+{
+	batch_stream_t stream;
+	_TCHAR batchURL[1024];
+	json_t *req = NULL;
+	char *post_body = NULL;
+	int responseCode;
+
+	ZeroMemory (&stream, sizeof(stream));
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD && update->fileSize <= BATCH_MAX_FILE_SIZE)
+			stream.count++;
+	}
+
+	//Not worth a separate request for a handful of files
+	if (stream.count < BATCH_MIN_FILES)
+		return;
+
+	stream.items = (update_t **)malloc(sizeof(*stream.items) * stream.count);
+	if (!stream.items)
+		return;
+
+	batchURL[0] = 0;
+
+	req = json_object();
+	json_t *hashes = json_array();
+	json_object_set_new(req, "hashes", hashes);
+
+	stream.count = 0;
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state != STATE_PENDING_DOWNLOAD || update->fileSize > BATCH_MAX_FILE_SIZE)
+			continue;
+
+		_TCHAR hash_string[41];
+		char whash_string[41];
+
+		HashToString(update->downloadhash, hash_string);
+		WideCharToMultiByte(CP_UTF8, 0, hash_string, -1, whash_string, sizeof(whash_string), NULL, NULL);
+
+		json_array_append_new(hashes, json_string(whash_string));
+
+		if (!batchURL[0] && !GetBatchURL(update->sourceURL, batchURL, sizeof(batchURL)))
+			goto failure;
+
+		stream.items[stream.count++] = update;
+	}
+
+	//Pending download hashes are unique by now, the cache merged any duplicates
+	qsort (stream.items, stream.count, sizeof(*stream.items), CompareDownloadHash);
+
+	post_body = json_dumps(req, JSON_COMPACT);
+	if (!post_body)
+		goto failure;
+
+	Status (_T("Downloading %d small files..."), stream.count);
+
+	DWORD startTick = GetTickCount();
+
+	if (!HTTPPostStream(batchURL, (BYTE *)post_body, (int)strlen(post_body), &responseCode, ReceiveBatchData, &stream))
+		Log (_T("Batch download stopped early (error code %d)"), responseCode);
+	else if (responseCode != 200)
+		Log (_T("Batch download not available (HTTP/%d)"), responseCode);
+
+	//Cut off in the middle of an object, it goes back to the normal downloads
+	AbortBatchEntry (&stream);
+
+	Log (_T("Batch download: %d of %d files (%I64d bytes) in %u ms"),
+		stream.received, stream.count, stream.receivedBytes, GetTickCount() - startTick);
+
+failure:
+	if (post_body)
+		free (post_body);
+	if (req)
+		json_decref (req);
+
+	free (stream.items);
+}
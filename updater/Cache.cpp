@@ -0,0 +1,589 @@
+#include "Updater.h"
+
+//Downloads live in a content-addressed cache, each file named by the hash of
+//what was downloaded. Identical files are fetched once, an update that has to
+//be retried keeps everything it already verified, and installs that point at
+//the same directory share it. The least recently used objects are dropped
+//once the cache grows past its limit.
+//Nothing is ever written under an object's name: each process writes to
+//<hash>.<pid>.download and renames it into place once it verified, so an
+//object that exists is always complete.
+
+static _TCHAR cacheDir[MAX_PATH];
+
+//Work files and sidecars nobody came back for are removed after a week
+#define CACHE_STALE_AGE		(7ULL * 24 * 60 * 60 * 10000000)
+
+typedef struct
+{
+	_TCHAR		name[64];
+	ULONGLONG	size;
+	ULONGLONG	lastUsed;
+} cache_object_t;
+
+BOOL InitDownloadCache (const _TCHAR *dir)
+{
+	_TCHAR path[MAX_PATH];
+
+	StringCbCopy(cacheDir, sizeof(cacheDir), dir);
+
+	StringCbPrintf(path, sizeof(path), _T("%s\\"), dir);
+	CreateFoldersForPath (path);
+
+	DWORD attributes = GetFileAttributes(cacheDir);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+VOID GetCachePath (const BYTE *hash, const _TCHAR *suffix, _TCHAR *path, size_t size)
+{
+	_TCHAR hashString[41];
+
+	HashToString ((BYTE *)hash, hashString);
+	StringCbPrintf(path, size, _T("%s\\%s%s"), cacheDir, hashString, suffix);
+}
+
+//Patches replace the download hash after the manifest was read, so the path is only settled here
+VOID SetCachePath (update_t *update)
+{
+	_TCHAR path[MAX_PATH];
+	_TCHAR suffix[32];
+
+	GetCachePath (update->downloadhash, _T(""), path, sizeof(path));
+
+	if (update->tempPath)
+		free (update->tempPath);
+
+	update->tempPath = _tcsdup(path);
+
+	StringCbPrintf(suffix, sizeof(suffix), _T(".%u.download"), GetCurrentProcessId());
+	GetCachePath (update->downloadhash, suffix, path, sizeof(path));
+
+	if (update->downloadPath)
+		free (update->downloadPath);
+
+	update->downloadPath = _tcsdup(path);
+}
+
+//Moves a verified download into the cache under its real name
+BOOL PublishCachedDownload (update_t *update)
+{
+	_TCHAR partialPath[MAX_PATH];
+
+	StringCbPrintf(partialPath, sizeof(partialPath), _T("%s.partial"), update->downloadPath);
+	DeleteFile (partialPath);
+
+	if (MoveFileEx(update->downloadPath, update->tempPath, MOVEFILE_REPLACE_EXISTING))
+		return TRUE;
+
+	//Another process published the same object first and has it open, it's just as good as ours
+	if (GetFileAttributes(update->tempPath) != INVALID_FILE_ATTRIBUTES)
+	{
+		DeleteFile (update->downloadPath);
+		return TRUE;
+	}
+
+	Log (_T("Download cache: couldn't store %s (error %d)"), update->outputPath, GetLastError());
+	DeleteFile (update->downloadPath);
+
+	return FALSE;
+}
+
+//qsort comparator for arrays of update_t pointers, grouping equal downloads
+int __cdecl CompareDownloadHash (const void *a, const void *b)
+{
+	const update_t *updateA = *(const update_t **)a;
+	const update_t *updateB = *(const update_t **)b;
+
+	return memcmp(updateA->downloadhash, updateB->downloadhash, 20);
+}
+
+//Pending downloads with the same hash share a cache object, so all but the first of
+//each run wait for it instead of fetching it again. items must be sorted by hash.
+int LinkDuplicateDownloads (update_t **items, int count)
+{
+	update_t *first = NULL;
+	int duplicates = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		update_t *update = items[i];
+
+		if (!first || memcmp(update->downloadhash, first->downloadhash, 20))
+		{
+			first = update;
+			continue;
+		}
+
+		//Anything already waiting on this one waits on the first instead
+		while (update->duplicates)
+		{
+			update_t *waiting = update->duplicates;
+
+			update->duplicates = waiting->nextDuplicate;
+			waiting->nextDuplicate = first->duplicates;
+			first->duplicates = waiting;
+		}
+
+		update->state = STATE_WAITING;
+		update->nextDuplicate = first->duplicates;
+		first->duplicates = update;
+
+		//Never downloaded, the first of the run brings it in
+		InterlockedExchangeAdd (&totalFileSize, -(LONG)update->fileSize);
+		update->skippedBytes = update->fileSize;
+		duplicates++;
+	}
+
+	return duplicates;
+}
+
+//The object is in the cache now, so everything waiting on it is done too. Returns
+//what was waiting, chained through nextDuplicate, for the caller to queue patches.
+update_t *CompleteDuplicates (update_t *update)
+{
+	update_t *duplicates = update->duplicates;
+
+	for (update_t *duplicate = duplicates; duplicate; duplicate = duplicate->nextDuplicate)
+	{
+		duplicate->state = STATE_DOWNLOADED;
+		InterlockedIncrement (&completedUpdates);
+	}
+
+	update->duplicates = NULL;
+
+	return duplicates;
+}
+
+static VOID CALLBACK VerifyCachedDownload (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	update_t *update = (update_t *)arg;
+	BYTE hash[20];
+
+	//Missing, or being replaced by another process right now, either way it's a miss
+	HANDLE hFile = CreateFile(update->tempPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	BOOL ret = CalculateHandleHash(hFile, hash);
+
+	CloseHandle (hFile);
+
+	if (!ret)
+		return;
+
+	//Never trust the cache blindly, the user may have touched it
+	if (!memcmp(hash, update->downloadhash, 20))
+		update->state = STATE_DOWNLOADED;
+	else
+		DeleteFile (update->tempPath);
+}
+
+VOID ReuseCachedDownloads (update_t *updates)
+{
+	update_t **items = NULL;
+	int count = 0;
+	int duplicates = 0;
+	int reused = 0;
+	LONGLONG reusedBytes = 0;
+	LONGLONG duplicatedBytes = 0;
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD)
+			count++;
+	}
+
+	if (!count)
+		return;
+
+	items = (update_t **)malloc(sizeof(*items) * count);
+	if (!items)
+		return;
+
+	count = 0;
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state != STATE_PENDING_DOWNLOAD)
+			continue;
+
+		SetCachePath (update);
+		items[count++] = update;
+	}
+
+	qsort (items, count, sizeof(*items), CompareDownloadHash);
+
+	//Same hash, same cache object, so only the first of a run needs checking or fetching
+	duplicates = LinkDuplicateDownloads(items, count);
+
+	work_pool_t pool;
+	CreateWorkPool (&pool, GetCoreCount());
+
+	for (int i = 0; i < count; i++)
+	{
+		if (items[i]->state == STATE_WAITING)
+		{
+			duplicatedBytes += items[i]->fileSize;
+			continue;
+		}
+
+		QueueWork (&pool, VerifyCachedDownload, items[i]);
+	}
+
+	FinishWorkPool (&pool);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (items[i]->state != STATE_DOWNLOADED)
+			continue;
+
+		reused++;
+		reusedBytes += items[i]->fileSize;
+		totalFileSize -= items[i]->fileSize;
+		items[i]->skippedBytes = items[i]->fileSize;
+		InterlockedIncrement (&completedUpdates);
+	}
+
+	//Separately, or the duplicates would be counted as reused files above
+	for (int i = 0; i < count; i++)
+	{
+		if (items[i]->state == STATE_DOWNLOADED)
+			CompleteDuplicates (items[i]);
+	}
+
+	free (items);
+
+	Log (_T("Download cache: %d files reused, %d duplicates, %I64d bytes not downloaded"), reused, duplicates, reusedBytes + duplicatedBytes);
+}
+
+VOID TouchCacheFile (const _TCHAR *path)
+{
+	FILETIME now;
+
+	HANDLE hFile = CreateFile(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	//Last access times are often switched off, so the write time doubles as the LRU stamp
+	GetSystemTimeAsFileTime (&now);
+	SetFileTime (hFile, NULL, NULL, &now);
+
+	CloseHandle (hFile);
+}
+
+VOID TouchCachedDownload (update_t *update)
+{
+	TouchCacheFile (update->tempPath);
+}
+
+static int __cdecl CompareLastUsed (const void *a, const void *b)
+{
+	const cache_object_t *objectA = (const cache_object_t *)a;
+	const cache_object_t *objectB = (const cache_object_t *)b;
+
+	if (objectA->lastUsed < objectB->lastUsed)
+		return -1;
+	if (objectA->lastUsed > objectB->lastUsed)
+		return 1;
+	return 0;
+}
+
+VOID TrimDownloadCache (ULONGLONG limit)
+{
+	_TCHAR search[MAX_PATH];
+	_TCHAR path[MAX_PATH];
+	WIN32_FIND_DATA findData;
+	cache_object_t *objects = NULL;
+	int count = 0;
+	int allocated = 0;
+	int removed = 0;
+	int stale = 0;
+	ULONGLONG total = 0;
+	FILETIME now;
+
+	GetSystemTimeAsFileTime (&now);
+
+	ULONGLONG staleBefore = (((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime) - CACHE_STALE_AGE;
+
+	StringCbPrintf(search, sizeof(search), _T("%s\\*"), cacheDir);
+
+	HANDLE hFind = FindFirstFile(search, &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+
+		ULONGLONG lastWrite = ((ULONGLONG)findData.ftLastWriteTime.dwHighDateTime << 32) | findData.ftLastWriteTime.dwLowDateTime;
+
+		//Bare hashes are objects and <hash>.chunks are chunk lists of installed files, both
+		//used until trimmed. The rest are work files and sidecars of a download in progress.
+		size_t length = _tcslen(findData.cFileName);
+
+		if (length != 40 && (length != 47 || _tcsicmp(findData.cFileName + 40, _T(".chunks"))))
+		{
+			StringCbPrintf(path, sizeof(path), _T("%s\\%s"), cacheDir, findData.cFileName);
+
+			if (lastWrite < staleBefore && DeleteFile(path))
+				stale++;
+
+			continue;
+		}
+
+		if (count == allocated)
+		{
+			allocated = allocated ? allocated * 2 : 256;
+
+			cache_object_t *grown = (cache_object_t *)realloc(objects, sizeof(*objects) * allocated);
+			if (!grown)
+				break;
+
+			objects = grown;
+		}
+
+		cache_object_t *object = &objects[count++];
+
+		StringCbCopy(object->name, sizeof(object->name), findData.cFileName);
+		object->size = ((ULONGLONG)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+		object->lastUsed = lastWrite;
+
+		total += object->size;
+	} while (FindNextFile(hFind, &findData));
+
+	FindClose (hFind);
+
+	if (total > limit)
+	{
+		qsort (objects, count, sizeof(*objects), CompareLastUsed);
+
+		for (int i = 0; i < count && total > limit; i++)
+		{
+			StringCbPrintf(path, sizeof(path), _T("%s\\%s"), cacheDir, objects[i].name);
+
+			//Objects in use by another install just stay until next time
+			if (DeleteFile(path))
+			{
+				total -= objects[i].size;
+				removed++;
+			}
+		}
+	}
+
+	if (objects)
+		free (objects);
+
+	Log (_T("Download cache: %I64u bytes in use, %d objects and chunk lists removed, %d stale work files removed"), total, removed, stale);
+}
+
+//Every installed file we hashed while evaluating the manifest, by content.
+//A file that only moved, or ships in more than one package, can then be
+//copied from where it already is instead of downloaded.
+VOID AddLocalFile (local_index_t *index, const BYTE *hash, const _TCHAR *path)
+{
+	static const BYTE missingHash[20] = {0};
+
+	if (!memcmp(hash, missingHash, 20))
+		return;
+
+	if (index->count == index->allocated)
+	{
+		int allocated = index->allocated ? index->allocated * 2 : 1024;
+
+		local_file_t *grown = (local_file_t *)realloc(index->files, sizeof(*grown) * allocated);
+		if (!grown)
+			return;
+
+		index->files = grown;
+		index->allocated = allocated;
+	}
+
+	local_file_t *file = &index->files[index->count];
+
+	file->path = _tcsdup(path);
+	if (!file->path)
+		return;
+
+	memcpy (file->hash, hash, 20);
+	index->count++;
+}
+
+VOID FreeLocalIndex (local_index_t *index)
+{
+	for (int i = 0; i < index->count; i++)
+		free (index->files[i].path);
+
+	if (index->files)
+		free (index->files);
+
+	index->files = NULL;
+	index->count = 0;
+	index->allocated = 0;
+}
+
+static int __cdecl CompareLocalFile (const void *a, const void *b)
+{
+	return memcmp(((const local_file_t *)a)->hash, ((const local_file_t *)b)->hash, 20);
+}
+
+typedef struct
+{
+	update_t		*update;
+	const _TCHAR	*source;
+} local_copy_t;
+
+//Copies into the cache rather than installing straight from the source, which
+//may itself be replaced by this update before the copy would be installed
+static VOID CALLBACK CopyLocalFile (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	local_copy_t *copy = (local_copy_t *)arg;
+	update_t *update = copy->update;
+	HANDLE hSrc = INVALID_HANDLE_VALUE;
+	HANDLE hDest = INVALID_HANDLE_VALUE;
+	BYTE *buffer = NULL;
+	BOOL ret = FALSE;
+	hash_sink_t sink;
+	DWORD read, wrote;
+	BYTE hash[20];
+
+	if (!HashSinkInit(&sink))
+		return;
+
+	buffer = (BYTE *)malloc(1048576);
+	if (!buffer)
+		goto failure;
+
+	hSrc = CreateFile(copy->source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hSrc == INVALID_HANDLE_VALUE)
+		goto failure;
+
+	hDest = CreateFile(update->downloadPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hDest == INVALID_HANDLE_VALUE)
+		goto failure;
+
+	while (ReadFile(hSrc, buffer, 1048576, &read, NULL) && read)
+	{
+		if (!WriteFile(hDest, buffer, read, &wrote, NULL) || wrote != read)
+			goto failure;
+
+		if (!HashSinkWrite(&sink, buffer, read))
+			goto failure;
+	}
+
+	ret = HashSinkFinish(&sink, hash) && !memcmp(hash, update->downloadhash, 20);
+
+failure:
+	HashSinkFree (&sink);
+
+	if (buffer)
+		free (buffer);
+
+	if (hSrc != INVALID_HANDLE_VALUE)
+		CloseHandle (hSrc);
+
+	if (hDest != INVALID_HANDLE_VALUE)
+		CloseHandle (hDest);
+
+	if (ret && PublishCachedDownload(update))
+		update->state = STATE_DOWNLOADED;
+	else if (hDest != INVALID_HANDLE_VALUE)
+		DeleteFile (update->downloadPath);
+}
+
+VOID ReuseLocalFiles (local_index_t *index, update_t *updates)
+{
+	update_t **items = NULL;
+	local_copy_t *copies = NULL;
+	int count = 0;
+	int copied = 0;
+	LONGLONG copiedBytes = 0;
+
+	if (!index->count)
+		return;
+
+	qsort (index->files, index->count, sizeof(*index->files), CompareLocalFile);
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD)
+			count++;
+	}
+
+	if (!count)
+		return;
+
+	items = (update_t **)malloc(sizeof(*items) * count);
+	copies = (local_copy_t *)malloc(sizeof(*copies) * count);
+	if (!items || !copies)
+		goto failure;
+
+	count = 0;
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD)
+			items[count++] = update;
+	}
+
+	//Grouped by hash so every cache object is only written by one copy
+	qsort (items, count, sizeof(*items), CompareDownloadHash);
+
+	work_pool_t pool;
+	CreateWorkPool (&pool, GetCoreCount());
+
+	int numCopies = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		local_file_t key;
+
+		if (i && !memcmp(items[i]->downloadhash, items[i - 1]->downloadhash, 20))
+			continue;
+
+		memcpy (key.hash, items[i]->downloadhash, 20);
+
+		local_file_t *match = (local_file_t *)bsearch(&key, index->files, index->count, sizeof(*index->files), CompareLocalFile);
+		if (!match)
+			continue;
+
+		//An object already in the cache is complete, cheaper to verify than to copy
+		if (GetFileAttributes(items[i]->tempPath) != INVALID_FILE_ATTRIBUTES)
+			continue;
+
+		copies[numCopies].update = items[i];
+		copies[numCopies].source = match->path;
+
+		Log (_T("Copying %s from %s"), items[i]->outputPath, match->path);
+
+		QueueWork (&pool, CopyLocalFile, &copies[numCopies++]);
+	}
+
+	FinishWorkPool (&pool);
+
+	for (int i = 0; i < count; i++)
+	{
+		//Others with the same hash share the object that was just copied
+		if (i && items[i]->state == STATE_PENDING_DOWNLOAD && items[i - 1]->state == STATE_DOWNLOADED &&
+			!memcmp(items[i]->downloadhash, items[i - 1]->downloadhash, 20))
+		{
+			items[i]->state = STATE_DOWNLOADED;
+		}
+
+		if (items[i]->state != STATE_DOWNLOADED)
+			continue;
+
+		copied++;
+		copiedBytes += items[i]->fileSize;
+		totalFileSize -= items[i]->fileSize;
+		items[i]->skippedBytes = items[i]->fileSize;
+		InterlockedIncrement (&completedUpdates);
+	}
+
+	Log (_T("Local files: %d updates satisfied from the install, %I64d bytes not downloaded"), copied, copiedBytes);
+
+failure:
+	if (items)
+		free (items);
+
+	if (copies)
+		free (copies);
+}
@@ -0,0 +1,632 @@
+#include "Updater.h"
+
+//Content-defined chunk store. Every file is cut into chunks wherever a rolling
+//gear hash hits a boundary, so identical runs of data produce identical chunks
+//no matter which file or offset they sit at. Once the server gave us the
+//chunk list of at least one new file, we chunk everything installed locally
+//and index the chunks by SHA-1; a new file is then put together from any
+//local file that has its chunks, and only the chunks nobody has are fetched. Many plugins ship the same runtime libraries, which this finds even
+//when they live under different names.
+//
+//Next to the files marked "chunks" in the manifest the server publishes
+//<file>.chunks in the same format we cache our own chunk lists in, little
+//endian:
+//	"OBSCHK01", DWORD chunk count, then for each chunk: DWORD length, SHA-1
+//
+//Chunking: the gear table is filled from a 64-bit LCG (multiplier
+//6364136223846793005, increment 1442695040888963407, seed CHUNK_GEAR_SEED),
+//taking the top 32 bits of each step. A chunk is at least CHUNK_MIN_SIZE
+//bytes; from there h = (h << 1) + gear[byte] and the chunk ends after the
+//first byte where (h & CHUNK_MASK) == 0, or at CHUNK_MAX_SIZE.
+
+#define CHUNK_LIST_MAGIC	"OBSCHK01"
+#define CHUNK_MIN_SIZE		(16 * 1024)
+#define CHUNK_MAX_SIZE		(256 * 1024)
+#define CHUNK_MASK			0xFFFF
+#define CHUNK_GEAR_SEED		0x4F4253434443ULL
+
+#pragma pack(push, r1, 1)
+
+typedef struct
+{
+	char		magic[8];
+	DWORD		count;
+} chunk_list_header_t;
+
+typedef struct
+{
+	DWORD		length;
+	BYTE		hash[20];
+} chunk_entry_t;
+
+#pragma pack(pop, r1)
+
+typedef struct
+{
+	const local_file_t	*file;
+	chunk_entry_t		*chunks;
+	DWORD				count;
+} local_chunks_t;
+
+typedef struct
+{
+	const BYTE	*hash;
+	int			source;
+	ULONGLONG	offset;
+	DWORD		length;
+} chunk_location_t;
+
+typedef struct
+{
+	update_t	*update;
+	chunk_entry_t	*chunks;
+	DWORD		count;
+	LONGLONG	reusedBytes;
+	LONGLONG	fetchedBytes;
+	BOOL		done;
+} chunk_job_t;
+
+static DWORD gear[256];
+
+static local_chunks_t *localChunks;
+static chunk_location_t *chunkTable;
+static DWORD chunkTableMask;
+
+static VOID InitGear ()
+{
+	ULONGLONG state = CHUNK_GEAR_SEED;
+
+	for (int i = 0; i < 256; i++)
+	{
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		gear[i] = (DWORD)(state >> 32);
+	}
+}
+
+static DWORD NextChunkLength (const BYTE *data, ULONGLONG remaining)
+{
+	if (remaining <= CHUNK_MIN_SIZE)
+		return (DWORD)remaining;
+
+	DWORD limit = (DWORD)min(remaining, CHUNK_MAX_SIZE);
+	DWORD h = 0;
+
+	for (DWORD i = CHUNK_MIN_SIZE; i < limit; i++)
+	{
+		h = (h << 1) + gear[data[i]];
+		if (!(h & CHUNK_MASK))
+			return i + 1;
+	}
+
+	return limit;
+}
+
+static BOOL ParseChunkList (const BYTE *data, size_t length, chunk_entry_t **chunks, DWORD *count)
+{
+	chunk_list_header_t header;
+
+	if (length < sizeof(header))
+		return FALSE;
+
+	memcpy (&header, data, sizeof(header));
+
+	//Checked by division first, the multiplication can wrap in a 32-bit build
+	if (memcmp(header.magic, CHUNK_LIST_MAGIC, sizeof(header.magic)) || header.count > (length - sizeof(header)) / sizeof(chunk_entry_t) ||
+		length != sizeof(header) + (size_t)header.count * sizeof(chunk_entry_t))
+		return FALSE;
+
+	*chunks = (chunk_entry_t *)malloc(sizeof(**chunks) * (header.count + 1));
+	if (!*chunks)
+		return FALSE;
+
+	memcpy (*chunks, data + sizeof(header), header.count * sizeof(chunk_entry_t));
+	*count = header.count;
+
+	return TRUE;
+}
+
+static BOOL LoadChunkList (const _TCHAR *path, chunk_entry_t **chunks, DWORD *count)
+{
+	BYTE *data = NULL;
+	LARGE_INTEGER size;
+	DWORD read;
+	BOOL ret = FALSE;
+
+	HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart > 0x1000000)
+		goto failure;
+
+	data = (BYTE *)malloc((size_t)size.QuadPart + 1);
+	if (!data)
+		goto failure;
+
+	if (!ReadFile(hFile, data, (DWORD)size.QuadPart, &read, NULL) || read != size.QuadPart)
+		goto failure;
+
+	ret = ParseChunkList(data, read, chunks, count);
+
+failure:
+	if (data)
+		free (data);
+
+	CloseHandle (hFile);
+
+	return ret;
+}
+
+static VOID SaveChunkList (const _TCHAR *path, const chunk_entry_t *chunks, DWORD count)
+{
+	chunk_list_header_t header;
+	DWORD wrote;
+	BOOL ret;
+
+	memcpy (header.magic, CHUNK_LIST_MAGIC, sizeof(header.magic));
+	header.count = count;
+
+	HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	ret = WriteFile(hFile, &header, sizeof(header), &wrote, NULL) && wrote == sizeof(header) &&
+		WriteFile(hFile, chunks, count * sizeof(*chunks), &wrote, NULL) && wrote == count * sizeof(*chunks);
+
+	CloseHandle (hFile);
+
+	if (!ret)
+		DeleteFile (path);
+}
+
+//Chunk lists of local files are kept in the download cache under the content
+//hash of the file, so only content we haven't seen before is ever chunked
+static VOID CALLBACK LoadLocalChunks (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	local_chunks_t *local = (local_chunks_t *)arg;
+	_TCHAR listPath[MAX_PATH];
+	HANDLE hMapping = NULL;
+	const BYTE *data = NULL;
+	chunk_entry_t *chunks = NULL;
+	LARGE_INTEGER size;
+	DWORD count = 0;
+
+	GetCachePath (local->file->hash, _T(".chunks"), listPath, sizeof(listPath));
+
+	//Still in use, so the cache trims it last
+	if (LoadChunkList(listPath, &local->chunks, &local->count))
+	{
+		TouchCacheFile (listPath);
+		return;
+	}
+
+	HANDLE hFile = CreateFile(local->file->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	if (!GetFileSizeEx(hFile, &size) || !size.QuadPart || size.QuadPart > CHUNK_MAX_LOCAL_SIZE)
+		goto failure;
+
+	hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!hMapping)
+		goto failure;
+
+	data = (const BYTE *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+		goto failure;
+
+	chunks = (chunk_entry_t *)malloc(sizeof(*chunks) * (DWORD)(size.QuadPart / CHUNK_MIN_SIZE + 1));
+	if (!chunks)
+		goto failure;
+
+	for (ULONGLONG offset = 0; offset < (ULONGLONG)size.QuadPart; )
+	{
+		DWORD length = NextChunkLength(data + offset, size.QuadPart - offset);
+		hash_sink_t sink;
+
+		if (!HashSinkInit(&sink))
+			goto failure;
+
+		if (!HashSinkWrite(&sink, data + offset, length))
+		{
+			HashSinkFree (&sink);
+			goto failure;
+		}
+
+		if (!HashSinkFinish(&sink, chunks[count].hash))
+			goto failure;
+
+		chunks[count++].length = length;
+		offset += length;
+	}
+
+	SaveChunkList (listPath, chunks, count);
+
+	local->chunks = chunks;
+	local->count = count;
+	chunks = NULL;
+
+failure:
+	if (chunks)
+		free (chunks);
+	if (data)
+		UnmapViewOfFile (data);
+	if (hMapping)
+		CloseHandle (hMapping);
+
+	CloseHandle (hFile);
+}
+
+static DWORD ChunkSlot (const BYTE *hash)
+{
+	DWORD slot;
+
+	memcpy (&slot, hash, sizeof(slot));
+	return slot & chunkTableMask;
+}
+
+static const chunk_location_t *FindChunk (const BYTE *hash)
+{
+	for (DWORD slot = ChunkSlot(hash); chunkTable[slot].hash; slot = (slot + 1) & chunkTableMask)
+	{
+		if (!memcmp(chunkTable[slot].hash, hash, 20))
+			return &chunkTable[slot];
+	}
+
+	return NULL;
+}
+
+static BOOL BuildChunkTable (int numSources)
+{
+	DWORD total = 0;
+
+	for (int i = 0; i < numSources; i++)
+		total += localChunks[i].count;
+
+	DWORD size = 1024;
+	while (size < total * 2)
+		size *= 2;
+
+	chunkTable = (chunk_location_t *)calloc(size, sizeof(*chunkTable));
+	if (!chunkTable)
+		return FALSE;
+
+	chunkTableMask = size - 1;
+
+	for (int i = 0; i < numSources; i++)
+	{
+		ULONGLONG offset = 0;
+
+		for (DWORD j = 0; j < localChunks[i].count; j++)
+		{
+			const chunk_entry_t *chunk = &localChunks[i].chunks[j];
+			DWORD slot = ChunkSlot(chunk->hash);
+
+			while (chunkTable[slot].hash && memcmp(chunkTable[slot].hash, chunk->hash, 20))
+				slot = (slot + 1) & chunkTableMask;
+
+			if (!chunkTable[slot].hash)
+			{
+				chunkTable[slot].hash = chunk->hash;
+				chunkTable[slot].source = i;
+				chunkTable[slot].offset = offset;
+				chunkTable[slot].length = chunk->length;
+			}
+
+			offset += chunk->length;
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOL FlushMissingChunks (chunk_job_t *job, HANDLE hFile, ULONGLONG start, ULONGLONG end)
+{
+	int responseCode;
+
+	if (start == end)
+		return TRUE;
+
+	if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		return FALSE;
+
+	if (!HTTPGetRange(job->update->sourceURL, hFile, start, end - start, &responseCode) || responseCode != 206)
+		return FALSE;
+
+	job->fetchedBytes += end - start;
+	return TRUE;
+}
+
+static VOID CALLBACK FetchChunkList (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	chunk_job_t *job = (chunk_job_t *)arg;
+
+	_TCHAR listURL[1024];
+	BYTE *listData = NULL;
+	int listLength = 0;
+	int responseCode;
+
+	if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		return;
+
+	StringCbPrintf(listURL, sizeof(listURL), _T("%s.chunks"), job->update->sourceURL);
+
+	if (!HTTPGetData(listURL, NULL, &responseCode, &listData, &listLength))
+		return;
+
+	if (responseCode == 200 && !ParseChunkList(listData, listLength, &job->chunks, &job->count))
+		job->chunks = NULL;
+
+	free (listData);
+}
+
+static VOID CALLBACK ChunkSyncFile (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	chunk_job_t *job = (chunk_job_t *)arg;
+	update_t *update = job->update;
+
+	const chunk_entry_t *chunks = job->chunks;
+	DWORD count = job->count;
+	BYTE *buffer = NULL;
+
+	HANDLE hNew = INVALID_HANDLE_VALUE;
+	HANDLE hSource = INVALID_HANDLE_VALUE;
+	int openSource = -1;
+
+	BOOL ret = FALSE;
+
+	ULONGLONG total = 0;
+	LONGLONG reused = 0;
+
+	for (DWORD i = 0; i < count; i++)
+	{
+		total += chunks[i].length;
+
+		if (FindChunk(chunks[i].hash))
+			reused += chunks[i].length;
+	}
+
+	if (total != (ULONGLONG)update->fileSize)
+		goto failure;
+
+	if (reused * 100 < (LONGLONG)total * DELTA_MIN_REUSE_PERCENT)
+		goto failure;
+
+	buffer = (BYTE *)malloc(CHUNK_MAX_SIZE);
+	if (!buffer)
+		goto failure;
+
+	hNew = CreateFile(update->downloadPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hNew == INVALID_HANDLE_VALUE)
+		goto failure;
+
+	LARGE_INTEGER newSize;
+	newSize.QuadPart = total;
+	if (!SetFilePointerEx(hNew, newSize, NULL, FILE_BEGIN) || !SetEndOfFile(hNew))
+		goto failure;
+
+	ULONGLONG offset = 0;
+	ULONGLONG missingStart = 0;
+
+	for (DWORD i = 0; i < count; i++)
+	{
+		const chunk_location_t *location = FindChunk(chunks[i].hash);
+
+		//Consecutive missing chunks go out as one range
+		if (!location || location->length != chunks[i].length || location->length > CHUNK_MAX_SIZE)
+		{
+			offset += chunks[i].length;
+			continue;
+		}
+
+		if (!FlushMissingChunks(job, hNew, missingStart, offset))
+			goto failure;
+
+		if (openSource != location->source)
+		{
+			if (hSource != INVALID_HANDLE_VALUE)
+				CloseHandle (hSource);
+
+			hSource = CreateFile(localChunks[location->source].file->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+			openSource = location->source;
+
+			if (hSource == INVALID_HANDLE_VALUE)
+				goto failure;
+		}
+
+		OVERLAPPED ov;
+		DWORD read, wrote;
+
+		ZeroMemory (&ov, sizeof(ov));
+		ov.Offset = (DWORD)location->offset;
+		ov.OffsetHigh = (DWORD)(location->offset >> 32);
+
+		if (!ReadFile(hSource, buffer, location->length, &read, &ov) || read != location->length)
+			goto failure;
+
+		ZeroMemory (&ov, sizeof(ov));
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+
+		if (!WriteFile(hNew, buffer, read, &wrote, &ov) || wrote != read)
+			goto failure;
+
+		offset += read;
+		missingStart = offset;
+	}
+
+	if (!FlushMissingChunks(job, hNew, missingStart, offset))
+		goto failure;
+
+	BYTE newHash[20];
+	LARGE_INTEGER zero;
+	zero.QuadPart = 0;
+
+	if (!SetFilePointerEx(hNew, zero, NULL, FILE_BEGIN) || !CalculateHandleHash(hNew, newHash))
+		goto failure;
+
+	if (memcmp(newHash, update->downloadhash, 20))
+	{
+		Log (_T("Chunked copy of %s didn't match the manifest hash"), update->outputPath);
+		goto failure;
+	}
+
+	job->reusedBytes = reused;
+	ret = TRUE;
+
+failure:
+	if (hSource != INVALID_HANDLE_VALUE)
+		CloseHandle (hSource);
+
+	if (hNew != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle (hNew);
+
+		if (ret)
+			ret = PublishCachedDownload(update);
+		else
+			DeleteFile (update->downloadPath);
+	}
+
+	if (!ret && job->fetchedBytes)
+		InterlockedExchangeAdd (&completedFileSize, -(LONG)job->fetchedBytes);
+
+	if (buffer)
+		free (buffer);
+
+	job->done = ret;
+}
+
+VOID RunChunkSync (local_index_t *index, update_t *updates)
+{
+	chunk_job_t *jobs = NULL;
+	int numSources = 0;
+	int numJobs = 0;
+	int numLists = 0;
+	int count = 0;
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD && !update->patchable && update->has_chunks && update->fileSize >= CHUNK_MIN_FILE_SIZE)
+			count++;
+	}
+
+	if (!count || !index->count)
+		return;
+
+	jobs = (chunk_job_t *)calloc(count, sizeof(*jobs));
+	if (!jobs)
+		return;
+
+	work_pool_t pool;
+
+	//The lists come first, chunking every local file is only worth it if there's something to match against
+	CreateWorkPool (&pool, DELTA_THREADS);
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state != STATE_PENDING_DOWNLOAD || update->patchable || !update->has_chunks || update->fileSize < CHUNK_MIN_FILE_SIZE)
+			continue;
+
+		jobs[numJobs].update = update;
+		QueueWork (&pool, FetchChunkList, &jobs[numJobs++]);
+	}
+
+	FinishWorkPool (&pool);
+
+	for (int i = 0; i < numJobs; i++)
+	{
+		if (jobs[i].chunks)
+			numLists++;
+	}
+
+	if (!numLists)
+	{
+		Log (_T("Chunk store: no chunk lists for %d files"), numJobs);
+		goto failure;
+	}
+
+	InitGear ();
+
+	localChunks = (local_chunks_t *)calloc(index->count, sizeof(*localChunks));
+	if (!localChunks)
+		goto failure;
+
+	CreateWorkPool (&pool, GetCoreCount());
+
+	//The index is sorted by hash by now, identical files only need chunking once
+	for (int i = 0; i < index->count; i++)
+	{
+		if (i && !memcmp(index->files[i].hash, index->files[i - 1].hash, 20))
+			continue;
+
+		localChunks[numSources].file = &index->files[i];
+		QueueWork (&pool, LoadLocalChunks, &localChunks[numSources++]);
+	}
+
+	FinishWorkPool (&pool);
+
+	if (!BuildChunkTable(numSources))
+		goto failure;
+
+	CreateWorkPool (&pool, DELTA_THREADS);
+
+	for (int i = 0; i < numJobs; i++)
+	{
+		if (jobs[i].chunks)
+			QueueWork (&pool, ChunkSyncFile, &jobs[i]);
+	}
+
+	FinishWorkPool (&pool);
+
+	int synced = 0;
+	LONGLONG reusedBytes = 0;
+	LONGLONG fetchedBytes = 0;
+
+	for (int i = 0; i < numJobs; i++)
+	{
+		if (!jobs[i].done)
+			continue;
+
+		jobs[i].update->state = STATE_DOWNLOADED;
+		InterlockedIncrement (&completedUpdates);
+		CompleteDuplicates (jobs[i].update);
+
+		totalFileSize -= (int)jobs[i].reusedBytes;
+		jobs[i].update->skippedBytes = (DWORD)jobs[i].reusedBytes;
+
+		synced++;
+		reusedBytes += jobs[i].reusedBytes;
+		fetchedBytes += jobs[i].fetchedBytes;
+	}
+
+	Log (_T("Chunk store: %d local files indexed, %d of %d files assembled, %I64d bytes reused, %I64d bytes fetched"),
+		numSources, synced, numLists, reusedBytes, fetchedBytes);
+
+failure:
+	if (chunkTable)
+	{
+		free (chunkTable);
+		chunkTable = NULL;
+	}
+
+	if (localChunks)
+	{
+		for (int i = 0; i < numSources; i++)
+		{
+			if (localChunks[i].chunks)
+				free (localChunks[i].chunks);
+		}
+
+		free (localChunks);
+		localChunks = NULL;
+	}
+
+	for (int i = 0; i < numJobs; i++)
+	{
+		if (jobs[i].chunks)
+			free (jobs[i].chunks);
+	}
+
+	free (jobs);
+}
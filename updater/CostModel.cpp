@@ -0,0 +1,139 @@
+#include "Updater.h"
+
+//Decides per file whether a patch is worth it. A patch saves download time
+//but costs bspatch time, which grows with the size of the file being
+//produced; on a fast connection a big file is often quicker to fetch whole.
+//Patches are applied on a worker per core behind the downloads still
+//running, so only a share of the bspatch time is really spent waiting.
+//Both rates are measured by earlier runs and kept in a small stats file:
+//	"OBSTPT01", download rate, then one patch rate per size bucket
+//All rates are bytes per millisecond, zero until something was measured.
+//Every decision is logged with its inputs so the model can be tuned.
+
+#define THROUGHPUT_MAGIC		"OBSTPT01"
+#define PATCH_RATE_BUCKETS		6
+
+//Until we've measured anything, assume roughly the old always-patch behaviour
+#define DEFAULT_DOWNLOAD_RATE	1024.0
+#define DEFAULT_PATCH_RATE		16384.0
+
+//Weight of a new sample against the history
+#define RATE_SMOOTHING			0.3
+
+#pragma pack(push, r1, 1)
+
+typedef struct
+{
+	char		magic[8];
+	double		downloadRate;
+	double		patchRate[PATCH_RATE_BUCKETS];
+} throughput_stats_t;
+
+#pragma pack(pop, r1)
+
+static throughput_stats_t stats;
+static CRITICAL_SECTION statsMutex;
+
+//Buckets of new file size: under 1MB, 4MB, 16MB, 64MB, 256MB and anything bigger
+static int PatchRateBucket (LONGLONG newSize)
+{
+	int bucket = 0;
+	LONGLONG limit = 1024 * 1024;
+
+	while (bucket < PATCH_RATE_BUCKETS - 1 && newSize >= limit)
+	{
+		bucket++;
+		limit *= 4;
+	}
+
+	return bucket;
+}
+
+static VOID SmoothRate (double *rate, double sample)
+{
+	*rate = *rate > 0.0 ? *rate * (1.0 - RATE_SMOOTHING) + sample * RATE_SMOOTHING : sample;
+}
+
+//Called once at startup, before any thread can record a rate
+VOID InitThroughputStats ()
+{
+	InitializeCriticalSection (&statsMutex);
+}
+
+VOID LoadThroughputStats (const _TCHAR *path)
+{
+	DWORD read;
+
+	ZeroMemory (&stats, sizeof(stats));
+
+	HANDLE hFile = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	if (!ReadFile(hFile, &stats, sizeof(stats), &read, NULL) || read != sizeof(stats) || memcmp(stats.magic, THROUGHPUT_MAGIC, sizeof(stats.magic)))
+		ZeroMemory (&stats, sizeof(stats));
+
+	CloseHandle (hFile);
+}
+
+VOID SaveThroughputStats (const _TCHAR *path)
+{
+	DWORD wrote;
+
+	memcpy (stats.magic, THROUGHPUT_MAGIC, sizeof(stats.magic));
+
+	HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	BOOL ret = WriteFile(hFile, &stats, sizeof(stats), &wrote, NULL) && wrote == sizeof(stats);
+
+	CloseHandle (hFile);
+
+	if (!ret)
+		DeleteFile (path);
+}
+
+//Rate of a single connection, which is what any one file gets
+VOID RecordDownloadRate (LONGLONG bytes, DWORD ms)
+{
+	if (bytes < 1024 * 1024 || !ms)
+		return;
+
+	EnterCriticalSection (&statsMutex);
+	SmoothRate (&stats.downloadRate, (double)bytes / (double)ms);
+	LeaveCriticalSection (&statsMutex);
+}
+
+//Covers the whole job: reading the old file, bspatch and hashing the result
+VOID RecordPatchRate (LONGLONG newSize, DWORD ms)
+{
+	if (newSize < 65536 || !ms)
+		return;
+
+	EnterCriticalSection (&statsMutex);
+	SmoothRate (&stats.patchRate[PatchRateBucket(newSize)], (double)newSize / (double)ms);
+	LeaveCriticalSection (&statsMutex);
+}
+
+//update->fileSize is still the full file here, which is also what the patch produces
+BOOL PatchIsCheaper (update_t *update, DWORD patchSize)
+{
+	double downloadRate = stats.downloadRate > 0.0 ? stats.downloadRate : DEFAULT_DOWNLOAD_RATE;
+	double patchRate = stats.patchRate[PatchRateBucket(update->fileSize)];
+
+	if (patchRate <= 0.0)
+		patchRate = DEFAULT_PATCH_RATE;
+
+	int patchWorkers = GetCoreCount();
+
+	double fullCost = (double)update->fileSize / downloadRate;
+	double patchCost = (double)patchSize / downloadRate + (double)update->fileSize / patchRate / patchWorkers;
+
+	BOOL usePatch = patchCost < fullCost;
+
+	Log (_T("Patch cost: %s patch %u + apply %u bytes on %d workers = %.0f ms, full %u bytes = %.0f ms (download %.0f, patch %.0f bytes/ms), using %s"),
+		update->outputPath, patchSize, update->fileSize, patchWorkers, patchCost, update->fileSize, fullCost, downloadRate, patchRate, usePatch ? _T("patch") : _T("full file"));
+
+	return usePatch;
+}
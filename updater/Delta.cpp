@@ -0,0 +1,407 @@
+#include "Updater.h"
+
+//Block delta for files the patch manifest doesn't cover. Next to the files
+//marked "blocks" in the manifest the server publishes <file>.blocks, a list of
+//checksums for each fixed size block of the new version. We slide a rolling checksum over the old copy we
+//already have, copy every block we can find locally and only fetch the rest
+//with range requests. The result is verified against the manifest hash like
+//any other download, anything going wrong falls back to a full download.
+//
+//.blocks format, little endian:
+//	"OBSBLK01", DWORD block size, ULONGLONG file size,
+//	then for each block: DWORD weak checksum, first 8 bytes of its SHA-1
+//
+//The weak checksum of bytes x[0..n-1] is (a & 0xFFFF) | (b << 16) with
+//a = sum of x[i] and b = sum of (n - i) * x[i].
+
+#define BLOCK_MAP_MAGIC		"OBSBLK01"
+#define BLOCK_BUCKETS		65536
+
+#pragma pack(push, r1, 1)
+
+typedef struct
+{
+	char		magic[8];
+	DWORD		blockSize;
+	ULONGLONG	fileSize;
+} block_map_header_t;
+
+typedef struct
+{
+	DWORD		weak;
+	BYTE		strong[8];
+} block_checksum_t;
+
+#pragma pack(pop, r1)
+
+typedef struct
+{
+	update_t	*update;
+	LONGLONG	reusedBytes;
+	LONGLONG	fetchedBytes;
+	BOOL		done;
+} delta_job_t;
+
+//rsync's checksum: a is the plain byte sum, b weights each byte by its distance from the end
+static inline DWORD WeakChecksum (DWORD a, DWORD b)
+{
+	return (a & 0xFFFF) | (b << 16);
+}
+
+static inline DWORD BlockBucket (DWORD weak)
+{
+	return (weak ^ (weak >> 16)) & (BLOCK_BUCKETS - 1);
+}
+
+static BOOL StrongChecksumMatches (const BYTE *data, DWORD length, const BYTE *strong)
+{
+	hash_sink_t sink;
+	BYTE hash[20];
+
+	if (!HashSinkInit(&sink))
+		return FALSE;
+
+	if (!HashSinkWrite(&sink, data, length))
+	{
+		HashSinkFree (&sink);
+		return FALSE;
+	}
+
+	return HashSinkFinish(&sink, hash) && !memcmp(hash, strong, 8);
+}
+
+static VOID CALLBACK DeltaSyncFile (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	delta_job_t *job = (delta_job_t *)arg;
+	update_t *update = job->update;
+
+	_TCHAR mapURL[1024];
+	BYTE *mapData = NULL;
+	int mapLength = 0;
+	int responseCode;
+
+	int *buckets = NULL;
+	int *nextInBucket = NULL;
+	LONGLONG *sourceOffsets = NULL;
+
+	HANDLE hOld = INVALID_HANDLE_VALUE;
+	HANDLE hMapping = NULL;
+	const BYTE *oldData = NULL;
+	HANDLE hNew = INVALID_HANDLE_VALUE;
+
+	BOOL ret = FALSE;
+
+	StringCbPrintf(mapURL, sizeof(mapURL), _T("%s.blocks"), update->sourceURL);
+
+	if (!HTTPGetData(mapURL, NULL, &responseCode, &mapData, &mapLength) || responseCode != 200)
+	{
+		//Not published for this file, a normal download it is
+		mapData = NULL;
+		goto failure;
+	}
+
+	if ((size_t)mapLength < sizeof(block_map_header_t))
+		goto failure;
+
+	block_map_header_t header;
+	memcpy (&header, mapData, sizeof(header));
+
+	if (memcmp(header.magic, BLOCK_MAP_MAGIC, sizeof(header.magic)) || header.fileSize != (ULONGLONG)update->fileSize)
+		goto failure;
+
+	if (header.blockSize < 1024 || header.blockSize > 16 * 1024 * 1024)
+		goto failure;
+
+	int numBlocks = (int)((header.fileSize + header.blockSize - 1) / header.blockSize);
+	if ((size_t)mapLength != sizeof(header) + numBlocks * sizeof(block_checksum_t))
+		goto failure;
+
+	const block_checksum_t *blocks = (const block_checksum_t *)(mapData + sizeof(header));
+
+	//Only whole blocks are matched, a short last block is always fetched
+	int fullBlocks = (int)(header.fileSize / header.blockSize);
+
+	buckets = (int *)malloc(sizeof(*buckets) * BLOCK_BUCKETS);
+	nextInBucket = (int *)malloc(sizeof(*nextInBucket) * (numBlocks + 1));
+	sourceOffsets = (LONGLONG *)malloc(sizeof(*sourceOffsets) * (numBlocks + 1));
+	if (!buckets || !nextInBucket || !sourceOffsets)
+		goto failure;
+
+	memset (buckets, 0xFF, sizeof(*buckets) * BLOCK_BUCKETS);
+
+	for (int i = 0; i < numBlocks; i++)
+	{
+		sourceOffsets[i] = -1;
+
+		if (i < fullBlocks)
+		{
+			DWORD bucket = BlockBucket(blocks[i].weak);
+			nextInBucket[i] = buckets[bucket];
+			buckets[bucket] = i;
+		}
+	}
+
+	//-------------------------------------
+	//Find new blocks in the old file
+	hOld = CreateFile(update->outputPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hOld == INVALID_HANDLE_VALUE)
+		goto failure;
+
+	LARGE_INTEGER oldSize;
+	if (!GetFileSizeEx(hOld, &oldSize) || oldSize.QuadPart < header.blockSize || oldSize.QuadPart > DELTA_MAX_OLD_SIZE)
+		goto failure;
+
+	hMapping = CreateFileMapping(hOld, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!hMapping)
+		goto failure;
+
+	oldData = (const BYTE *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	if (!oldData)
+		goto failure;
+
+	LONGLONG reused = 0;
+	LONGLONG oldLength = oldSize.QuadPart;
+	DWORD blockSize = header.blockSize;
+	DWORD a = 0, b = 0;
+
+	for (DWORD i = 0; i < blockSize; i++)
+	{
+		a += oldData[i];
+		b += (blockSize - i) * oldData[i];
+	}
+
+	for (LONGLONG pos = 0; pos + blockSize <= oldLength; )
+	{
+		DWORD weak = WeakChecksum(a, b);
+		int match = -1;
+
+		for (int i = buckets[BlockBucket(weak)]; i != -1; i = nextInBucket[i])
+		{
+			if (blocks[i].weak != weak)
+				continue;
+
+			if (!StrongChecksumMatches(oldData + pos, blockSize, blocks[i].strong))
+				continue;
+
+			match = i;
+			break;
+		}
+
+		if (match != -1)
+		{
+			//The same content can appear in several blocks of the new file, they can all come from here
+			for (int i = match; i != -1; i = nextInBucket[i])
+			{
+				if (sourceOffsets[i] == -1 && blocks[i].weak == weak && !memcmp(blocks[i].strong, blocks[match].strong, 8))
+				{
+					sourceOffsets[i] = pos;
+					reused += blockSize;
+				}
+			}
+
+			pos += blockSize;
+
+			if (pos + blockSize > oldLength)
+				break;
+
+			a = b = 0;
+			for (DWORD i = 0; i < blockSize; i++)
+			{
+				a += oldData[pos + i];
+				b += (blockSize - i) * oldData[pos + i];
+			}
+
+			continue;
+		}
+
+		if (pos + blockSize >= oldLength)
+			break;
+
+		BYTE out = oldData[pos];
+		BYTE in = oldData[pos + blockSize];
+
+		a = a - out + in;
+		b = b - blockSize * out + a;
+		pos++;
+	}
+
+	//Lots of small range requests for little gain lose against one compressed download
+	if (reused * 100 < (LONGLONG)header.fileSize * DELTA_MIN_REUSE_PERCENT)
+		goto failure;
+
+	//-------------------------------------
+	//Assemble the new file
+	hNew = CreateFile(update->downloadPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hNew == INVALID_HANDLE_VALUE)
+		goto failure;
+
+	LARGE_INTEGER newSize;
+	newSize.QuadPart = header.fileSize;
+	if (!SetFilePointerEx(hNew, newSize, NULL, FILE_BEGIN) || !SetEndOfFile(hNew))
+		goto failure;
+
+	for (int i = 0; i < numBlocks; i++)
+	{
+		if (sourceOffsets[i] == -1)
+			continue;
+
+		OVERLAPPED ov;
+		DWORD wrote;
+		ULONGLONG offset = (ULONGLONG)i * blockSize;
+
+		ZeroMemory (&ov, sizeof(ov));
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+
+		if (!WriteFile(hNew, oldData + sourceOffsets[i], blockSize, &wrote, &ov) || wrote != blockSize)
+			goto failure;
+	}
+
+	//Consecutive missing blocks go out as one range
+	for (int i = 0; i < numBlocks; )
+	{
+		if (sourceOffsets[i] != -1)
+		{
+			i++;
+			continue;
+		}
+
+		int first = i;
+		while (i < numBlocks && sourceOffsets[i] == -1)
+			i++;
+
+		ULONGLONG start = (ULONGLONG)first * blockSize;
+		ULONGLONG end = min((ULONGLONG)i * blockSize, header.fileSize);
+
+		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+			goto failure;
+
+		if (!HTTPGetRange(update->sourceURL, hNew, start, end - start, &responseCode) || responseCode != 206)
+			goto failure;
+
+		job->fetchedBytes += end - start;
+	}
+
+	BYTE newHash[20];
+	LARGE_INTEGER zero;
+	zero.QuadPart = 0;
+
+	if (!SetFilePointerEx(hNew, zero, NULL, FILE_BEGIN) || !CalculateHandleHash(hNew, newHash))
+		goto failure;
+
+	if (memcmp(newHash, update->downloadhash, 20))
+	{
+		Log (_T("Block delta for %s didn't match the manifest hash"), update->outputPath);
+		goto failure;
+	}
+
+	job->reusedBytes = reused;
+	ret = TRUE;
+
+failure:
+	if (hNew != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle (hNew);
+
+		if (ret)
+			ret = PublishCachedDownload(update);
+		else
+			DeleteFile (update->downloadPath);
+	}
+
+	//It's downloaded in full after all, don't count these bytes twice. A range that
+	//failed partway already took its own bytes back.
+	if (!ret && job->fetchedBytes)
+		InterlockedExchangeAdd (&completedFileSize, -(LONG)job->fetchedBytes);
+
+	if (oldData)
+		UnmapViewOfFile (oldData);
+	if (hMapping)
+		CloseHandle (hMapping);
+	if (hOld != INVALID_HANDLE_VALUE)
+		CloseHandle (hOld);
+
+	if (buckets)
+		free (buckets);
+	if (nextInBucket)
+		free (nextInBucket);
+	if (sourceOffsets)
+		free (sourceOffsets);
+	if (mapData)
+		free (mapData);
+
+	job->done = ret;
+}
+
+VOID RunDeltaSync (update_t *updates)
+{
+	static const BYTE missingHash[20] = {0};
+	delta_job_t *jobs = NULL;
+	int count = 0;
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD)
+			count++;
+	}
+
+	if (!count)
+		return;
+
+	jobs = (delta_job_t *)malloc(sizeof(*jobs) * count);
+	if (!jobs)
+		return;
+
+	work_pool_t pool;
+	CreateWorkPool (&pool, DELTA_THREADS);
+
+	int numJobs = 0;
+
+	//Only full downloads of files we have an older copy of
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state != STATE_PENDING_DOWNLOAD || update->patchable || !update->has_blocks || update->fileSize < DELTA_MIN_SIZE)
+			continue;
+
+		if (!update->has_hash || !memcmp(update->my_hash, missingHash, 20))
+			continue;
+
+		delta_job_t *job = &jobs[numJobs++];
+
+		job->update = update;
+		job->reusedBytes = 0;
+		job->fetchedBytes = 0;
+		job->done = FALSE;
+
+		QueueWork (&pool, DeltaSyncFile, job);
+	}
+
+	FinishWorkPool (&pool);
+
+	int synced = 0;
+	LONGLONG reusedBytes = 0;
+	LONGLONG fetchedBytes = 0;
+
+	for (int i = 0; i < numJobs; i++)
+	{
+		if (!jobs[i].done)
+			continue;
+
+		jobs[i].update->state = STATE_DOWNLOADED;
+		InterlockedIncrement (&completedUpdates);
+		CompleteDuplicates (jobs[i].update);
+
+		//The fetched part was already counted as it came in
+		totalFileSize -= (int)jobs[i].reusedBytes;
+		jobs[i].update->skippedBytes = (DWORD)jobs[i].reusedBytes;
+
+		synced++;
+		reusedBytes += jobs[i].reusedBytes;
+		fetchedBytes += jobs[i].fetchedBytes;
+	}
+
+	free (jobs);
+
+	if (numJobs)
+		Log (_T("Block delta: %d of %d files, %I64d bytes reused, %I64d bytes fetched"), synced, numJobs, reusedBytes, fetchedBytes);
+}
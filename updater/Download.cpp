@@ -0,0 +1,1153 @@
+#include "Updater.h"
+
+//Each worker owns a deque of pending downloads. The owner takes work from the
+//front, idle workers steal from the back of someone else's deque, so nobody
+//walks the whole update list under a global lock.
+typedef struct
+{
+	CRITICAL_SECTION	lock;
+	update_t			**items;
+	int					head;
+	int					tail;
+	LONGLONG			plannedBytes;
+	DWORD				finishTick;
+	LONGLONG			networkBytes;
+	DWORD				networkMs;
+} download_queue_t;
+
+static download_queue_t queues[MAX_DOWNLOAD_THREADS];
+
+static update_t *NextDownload (int self)
+{
+	update_t *update = NULL;
+	download_queue_t *queue = &queues[self];
+
+	EnterCriticalSection (&queue->lock);
+	if (queue->head != queue->tail)
+		update = queue->items[queue->head++];
+	LeaveCriticalSection (&queue->lock);
+
+	for (int i = 1; !update && i < MAX_DOWNLOAD_THREADS; i++)
+	{
+		queue = &queues[(self + i) % MAX_DOWNLOAD_THREADS];
+
+		EnterCriticalSection (&queue->lock);
+		if (queue->head != queue->tail)
+			update = queue->items[--queue->tail];
+		LeaveCriticalSection (&queue->lock);
+	}
+
+	return update;
+}
+
+static int __cdecl CompareDownloadSize (const void *a, const void *b)
+{
+	const update_t *updateA = *(const update_t **)a;
+	const update_t *updateB = *(const update_t **)b;
+
+	if (updateA->fileSize > updateB->fileSize)
+		return -1;
+	if (updateA->fileSize < updateB->fileSize)
+		return 1;
+	return 0;
+}
+
+//Longest-first list scheduling: every file goes to the worker with the least
+//bytes planned so far, so the big files start immediately and the small ones
+//fill in the gaps instead of one large file trailing at the end.
+static LONGLONG PlanDownloads (update_t **items, int count, int num)
+{
+	LONGLONG makespan = 0;
+
+	qsort (items, count, sizeof(*items), CompareDownloadSize);
+
+	for (int i = 0; i < count; i++)
+	{
+		download_queue_t *queue = &queues[0];
+
+		for (int j = 1; j < num; j++)
+		{
+			if (queues[j].plannedBytes < queue->plannedBytes)
+				queue = &queues[j];
+		}
+
+		queue->items[queue->tail++] = items[i];
+		queue->plannedBytes += items[i]->fileSize;
+
+		if (queue->plannedBytes > makespan)
+			makespan = queue->plannedBytes;
+	}
+
+	return makespan;
+}
+
+static BOOL DownloadsRemaining ()
+{
+	BOOL remaining = FALSE;
+
+	for (int i = 0; !remaining && i < MAX_DOWNLOAD_THREADS; i++)
+	{
+		EnterCriticalSection (&queues[i].lock);
+		remaining = (queues[i].head != queues[i].tail);
+		LeaveCriticalSection (&queues[i].lock);
+	}
+
+	return remaining;
+}
+
+//A download that stops early leaves its partial file in the temp directory
+//with a small sidecar next to it recording which download it belongs to and
+//how many bytes were written and hashed, so the next attempt can ask for just
+//the rest.
+#define PARTIAL_MAGIC	"OBSPRTv2"
+
+typedef struct
+{
+	char		magic[8];
+	ULONGLONG	length;
+	BYTE		downloadhash[20];
+} partial_info_t;
+
+static VOID GetPartialInfoPath (update_t *update, _TCHAR *path, size_t size)
+{
+	StringCbPrintf(path, size, _T("%s.partial"), update->downloadPath);
+}
+
+static VOID DiscardPartialDownload (update_t *update)
+{
+	_TCHAR infoPath[MAX_PATH];
+
+	GetPartialInfoPath (update, infoPath, sizeof(infoPath));
+
+	DeleteFile (update->downloadPath);
+	DeleteFile (infoPath);
+}
+
+static VOID SavePartialDownload (update_t *update, ULONGLONG length)
+{
+	_TCHAR infoPath[MAX_PATH];
+	partial_info_t info;
+	DWORD wrote;
+
+	if (!length)
+	{
+		DiscardPartialDownload (update);
+		return;
+	}
+
+	GetPartialInfoPath (update, infoPath, sizeof(infoPath));
+
+	memcpy (info.magic, PARTIAL_MAGIC, sizeof(info.magic));
+	info.length = length;
+	memcpy (info.downloadhash, update->downloadhash, sizeof(info.downloadhash));
+
+	HANDLE hFile = CreateFile(infoPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	WriteFile (hFile, &info, sizeof(info), &wrote, NULL);
+	CloseHandle (hFile);
+
+	Log (_T("Kept %I64u bytes of %s for resuming"), length, update->outputPath);
+}
+
+//Work files are named after the process that wrote them, so what an earlier
+//run left behind has to be taken over first. Renaming the sidecar is the
+//claim, only one process can win it.
+static VOID AdoptPartialDownload (update_t *update, const _TCHAR *infoPath)
+{
+	_TCHAR search[MAX_PATH];
+	_TCHAR dir[MAX_PATH];
+	_TCHAR orphanInfo[MAX_PATH];
+	_TCHAR orphanData[MAX_PATH];
+	WIN32_FIND_DATA findData;
+
+	if (GetFileAttributes(infoPath) != INVALID_FILE_ATTRIBUTES)
+		return;
+
+	StringCbCopy(dir, sizeof(dir), update->tempPath);
+	_TCHAR *p = _tcsrchr(dir, '\\');
+	if (!p)
+		return;
+	*p = 0;
+
+	StringCbPrintf(search, sizeof(search), _T("%s.*.download.partial"), update->tempPath);
+
+	HANDLE hFind = FindFirstFile(search, &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		StringCbPrintf(orphanInfo, sizeof(orphanInfo), _T("%s\\%s"), dir, findData.cFileName);
+
+		if (!MoveFile(orphanInfo, infoPath))
+			continue;
+
+		//Strip ".partial" to get the data file it describes
+		StringCbCopy(orphanData, sizeof(orphanData), orphanInfo);
+		orphanData[_tcslen(orphanData) - 8] = 0;
+
+		if (MoveFileEx(orphanData, update->downloadPath, MOVEFILE_REPLACE_EXISTING))
+			break;
+
+		DeleteFile (infoPath);
+	} while (FindNextFile(hFind, &findData));
+
+	FindClose (hFind);
+}
+
+//How much a stopped download kept, zero without a usable sidecar
+static ULONGLONG GetPartialLength (update_t *update)
+{
+	_TCHAR infoPath[MAX_PATH];
+	partial_info_t info;
+	DWORD read;
+
+	GetPartialInfoPath (update, infoPath, sizeof(infoPath));
+
+	HANDLE hFile = CreateFile(infoPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	BOOL valid = ReadFile(hFile, &info, sizeof(info), &read, NULL) && read == sizeof(info) && !memcmp(info.magic, PARTIAL_MAGIC, sizeof(info.magic)) &&
+		!memcmp(info.downloadhash, update->downloadhash, 20);
+
+	CloseHandle (hFile);
+
+	return valid ? info.length : 0;
+}
+
+//CryptoAPI can't save a hash in progress, so the bytes we already have are
+//hashed again from disk, which is still far cheaper than fetching them again.
+static ULONGLONG ResumePartialDownload (update_t *update, hash_sink_t *sink)
+{
+	_TCHAR infoPath[MAX_PATH];
+	partial_info_t info;
+	LARGE_INTEGER size;
+	BYTE *buffer = NULL;
+	ULONGLONG length = 0;
+	DWORD read;
+
+	GetPartialInfoPath (update, infoPath, sizeof(infoPath));
+	AdoptPartialDownload (update, infoPath);
+
+	HANDLE hFile = CreateFile(infoPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	BOOL valid = ReadFile(hFile, &info, sizeof(info), &read, NULL) && read == sizeof(info) && !memcmp(info.magic, PARTIAL_MAGIC, sizeof(info.magic));
+	CloseHandle (hFile);
+
+	//The bytes on disk belong to some other download, they're no use to this one
+	if (valid && memcmp(info.downloadhash, update->downloadhash, 20))
+	{
+		Log (_T("Partial download of %s is for a different file, starting over"), update->outputPath);
+		valid = FALSE;
+	}
+
+	//Whatever happens below the sidecar is stale now, it's rewritten if this attempt stops early too
+	DeleteFile (infoPath);
+
+	if (!valid)
+		return 0;
+
+	hFile = CreateFile(update->downloadPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	if (!GetFileSizeEx(hFile, &size))
+		goto failure;
+
+	buffer = (BYTE *)malloc(65536);
+	if (!buffer)
+		goto failure;
+
+	//Only trust what both the sidecar and the file agree on
+	ULONGLONG validated = min(info.length, (ULONGLONG)size.QuadPart);
+
+	while (length < validated)
+	{
+		DWORD want = (DWORD)min(validated - length, 65536);
+
+		if (!ReadFile(hFile, buffer, want, &read, NULL) || read != want)
+			goto failure;
+
+		if (!HashSinkWrite(sink, buffer, read))
+			goto failure;
+
+		length += read;
+	}
+
+	size.QuadPart = length;
+	if (!SetFilePointerEx(hFile, size, NULL, FILE_BEGIN) || !SetEndOfFile(hFile))
+		goto failure;
+
+	free (buffer);
+	CloseHandle (hFile);
+
+	return length;
+
+failure:
+	if (buffer)
+		free (buffer);
+
+	CloseHandle (hFile);
+
+	//Start from scratch with a fresh hash, the download truncates the file
+	HashSinkFree (sink);
+	HashSinkInit (sink);
+
+	return 0;
+}
+
+//Large files are fetched as byte ranges into a preallocated temp file. The
+//worker that picked the file publishes it, and workers that run out of files
+//of their own join in and claim ranges until none are left. Each connection
+//sizes its next range from the throughput of its last one.
+typedef struct
+{
+	ULONGLONG	start;
+	ULONGLONG	length;
+} segment_t;
+
+typedef struct
+{
+	update_t			*update;
+	HANDLE				hFile;
+	ULONGLONG			size;
+	ULONGLONG			nextOffset;
+	ULONGLONG			contiguous;
+	segment_t			*finished;
+	int					numFinished;
+	int					numSegments;
+	int					helpers;
+	int					maxHelpers;
+	BOOL				failed;
+	int					errorCode;
+} segmented_download_t;
+
+#define SEGMENTED_OK			0
+#define SEGMENTED_FAILED		1
+#define SEGMENTED_UNSUPPORTED	2
+
+static CRITICAL_SECTION segmentLock;
+static CONDITION_VARIABLE segmentHelpersDone;
+static segmented_download_t *activeSegmented;
+
+static BOOL ClaimSegment (segmented_download_t *seg, ULONGLONG want, ULONGLONG *start, ULONGLONG *length)
+{
+	BOOL ret = FALSE;
+
+	EnterCriticalSection (&segmentLock);
+
+	if (!seg->failed && seg->nextOffset < seg->size)
+	{
+		ULONGLONG remaining = seg->size - seg->nextOffset;
+
+		//Leave some of the file for anyone who joins late
+		want = min(want, max(remaining / 2, DOWNLOAD_SEGMENT_MIN));
+		want = min(want, remaining);
+
+		*start = seg->nextOffset;
+		*length = want;
+
+		seg->nextOffset += want;
+		seg->numSegments++;
+		ret = TRUE;
+	}
+
+	LeaveCriticalSection (&segmentLock);
+
+	return ret;
+}
+
+//Moves the contiguous mark past any finished ranges that now line up with it,
+//that's how much a failed download can keep for resuming
+static VOID FinishSegment (segmented_download_t *seg, ULONGLONG start, ULONGLONG length)
+{
+	EnterCriticalSection (&segmentLock);
+
+	seg->finished[seg->numFinished].start = start;
+	seg->finished[seg->numFinished].length = length;
+	seg->numFinished++;
+
+	for (int i = 0; i < seg->numFinished; )
+	{
+		if (seg->finished[i].start == seg->contiguous)
+		{
+			seg->contiguous += seg->finished[i].length;
+			seg->finished[i] = seg->finished[--seg->numFinished];
+			i = 0;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	LeaveCriticalSection (&segmentLock);
+}
+
+static VOID FailSegmented (segmented_download_t *seg, int errorCode)
+{
+	EnterCriticalSection (&segmentLock);
+
+	if (!seg->failed)
+	{
+		seg->failed = TRUE;
+		seg->errorCode = errorCode;
+	}
+
+	LeaveCriticalSection (&segmentLock);
+}
+
+static VOID RunSegments (segmented_download_t *seg, double rate)
+{
+	ULONGLONG start, length;
+
+	for (;;)
+	{
+		ULONGLONG want = rate > 0.0 ? (ULONGLONG)(rate * DOWNLOAD_SEGMENT_TARGET_MS) : DOWNLOAD_SEGMENT_MIN;
+		want = max(min(want, DOWNLOAD_SEGMENT_MAX), DOWNLOAD_SEGMENT_MIN);
+
+		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		{
+			FailSegmented (seg, -14);
+			break;
+		}
+
+		if (!ClaimSegment(seg, want, &start, &length))
+			break;
+
+		int responseCode;
+		DWORD startTick = GetTickCount();
+
+		if (!HTTPGetRange(seg->update->sourceURL, seg->hFile, start, length, &responseCode) || responseCode != 206)
+		{
+			FailSegmented (seg, responseCode);
+			break;
+		}
+
+		rate = (double)length / (double)max(GetTickCount() - startTick, 1);
+
+		FinishSegment (seg, start, length);
+	}
+}
+
+//Called by a worker with nothing else to do, returns FALSE if there was nothing to help with
+static BOOL HelpSegmentedDownload ()
+{
+	segmented_download_t *seg;
+
+	EnterCriticalSection (&segmentLock);
+
+	seg = activeSegmented;
+	if (seg && !seg->failed && seg->nextOffset < seg->size)
+	{
+		seg->helpers++;
+		seg->maxHelpers = max(seg->maxHelpers, seg->helpers);
+	}
+	else
+	{
+		seg = NULL;
+	}
+
+	LeaveCriticalSection (&segmentLock);
+
+	if (!seg)
+		return FALSE;
+
+	RunSegments (seg, 0.0);
+
+	EnterCriticalSection (&segmentLock);
+	if (--seg->helpers == 0)
+		WakeAllConditionVariable (&segmentHelpersDone);
+	LeaveCriticalSection (&segmentLock);
+
+	return TRUE;
+}
+
+static BOOL SegmentsRemaining ()
+{
+	EnterCriticalSection (&segmentLock);
+	BOOL remaining = activeSegmented && !activeSegmented->failed && activeSegmented->nextOffset < activeSegmented->size;
+	LeaveCriticalSection (&segmentLock);
+
+	return remaining;
+}
+
+static int DownloadSegmented (update_t *update, ULONGLONG resumeOffset, hash_sink_t *sink, int *responseCode)
+{
+	segmented_download_t seg;
+	LARGE_INTEGER size;
+	BYTE *buffer = NULL;
+	int ret = SEGMENTED_FAILED;
+
+	ZeroMemory (&seg, sizeof(seg));
+
+	seg.update = update;
+	seg.size = update->fileSize;
+	seg.nextOffset = resumeOffset;
+	seg.contiguous = resumeOffset;
+
+	//Every range but the last is at least DOWNLOAD_SEGMENT_MIN
+	seg.finished = (segment_t *)malloc(sizeof(*seg.finished) * (size_t)((seg.size - resumeOffset) / DOWNLOAD_SEGMENT_MIN + 2));
+	if (!seg.finished)
+	{
+		*responseCode = -6;
+		return SEGMENTED_FAILED;
+	}
+
+	seg.hFile = CreateFile(update->downloadPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, 0, NULL);
+	if (seg.hFile == INVALID_HANDLE_VALUE)
+	{
+		free (seg.finished);
+		*responseCode = -7;
+		return SEGMENTED_FAILED;
+	}
+
+	size.QuadPart = seg.size;
+	if (!SetFilePointerEx(seg.hFile, size, NULL, FILE_BEGIN) || !SetEndOfFile(seg.hFile))
+	{
+		*responseCode = -7;
+		goto failure;
+	}
+
+	//The first range is ours alone, it tells us whether the server can do this at all
+	ULONGLONG start, length;
+	DWORD startTick = GetTickCount();
+
+	ClaimSegment (&seg, DOWNLOAD_SEGMENT_MIN, &start, &length);
+
+	if (!HTTPGetRange(update->sourceURL, seg.hFile, start, length, responseCode))
+		goto failure;
+
+	if (*responseCode != 206)
+	{
+		ret = SEGMENTED_UNSUPPORTED;
+		goto failure;
+	}
+
+	double rate = (double)length / (double)max(GetTickCount() - startTick, 1);
+
+	FinishSegment (&seg, start, length);
+
+	//Only one file is shared with idle workers at a time, any other large file just carries on alone
+	EnterCriticalSection (&segmentLock);
+	if (!activeSegmented)
+		activeSegmented = &seg;
+	LeaveCriticalSection (&segmentLock);
+
+	RunSegments (&seg, rate);
+
+	EnterCriticalSection (&segmentLock);
+
+	if (activeSegmented == &seg)
+		activeSegmented = NULL;
+
+	while (seg.helpers)
+		SleepConditionVariableCS (&segmentHelpersDone, &segmentLock, INFINITE);
+
+	LeaveCriticalSection (&segmentLock);
+
+	if (seg.failed || seg.contiguous != seg.size)
+	{
+		*responseCode = seg.errorCode;
+		goto failure;
+	}
+
+	//Ranges arrive out of order, so the part we didn't already hash while resuming is read back once at the end
+	buffer = (BYTE *)malloc(65536);
+	if (!buffer)
+	{
+		*responseCode = -6;
+		goto failure;
+	}
+
+	size.QuadPart = resumeOffset;
+	if (!SetFilePointerEx(seg.hFile, size, NULL, FILE_BEGIN))
+	{
+		*responseCode = -15;
+		goto failure;
+	}
+
+	for (ULONGLONG position = resumeOffset; position < seg.size; )
+	{
+		DWORD want = (DWORD)min(seg.size - position, 65536);
+		DWORD read;
+
+		if (!ReadFile(seg.hFile, buffer, want, &read, NULL) || read != want || !HashSinkWrite(sink, buffer, read))
+		{
+			*responseCode = -15;
+			goto failure;
+		}
+
+		position += read;
+	}
+
+	Log (_T("Downloaded %s in %d ranges, up to %d helper connections"), update->outputPath, seg.numSegments, seg.maxHelpers);
+
+	*responseCode = 200;
+	ret = SEGMENTED_OK;
+
+failure:
+	if (buffer)
+		free (buffer);
+
+	CloseHandle (seg.hFile);
+
+	//Only the contiguous part is kept for resuming, ranges finished past a gap are fetched again
+	if (ret == SEGMENTED_FAILED)
+	{
+		LONGLONG discarded = 0;
+
+		for (int i = 0; i < seg.numFinished; i++)
+			discarded += seg.finished[i].length;
+
+		InterlockedExchangeAdd (&completedFileSize, -(LONG)discarded);
+		SavePartialDownload (update, seg.contiguous);
+	}
+
+	free (seg.finished);
+
+	return ret;
+}
+
+static volatile LONG retryBudget;
+
+//Our own failures, a cancel and anything the server says is our fault won't get better by asking again
+static BOOL IsRetryable (int responseCode)
+{
+	//Out of memory, couldn't create or write the file, cancelled, couldn't hash
+	if (responseCode == -6 || responseCode == -7 || (responseCode <= -10 && responseCode >= -15))
+		return FALSE;
+
+	if (responseCode >= 400 && responseCode < 500)
+		return responseCode == 408 || responseCode == 429;
+
+	return TRUE;
+}
+
+//Switches a patch over to the full file it was meant to produce
+BOOL FallBackToFullDownload (update_t *update)
+{
+	if (!update->patchable || !update->fullSourceURL)
+		return FALSE;
+
+	Log (_T("Downloading all of %s instead of a patch"), update->outputPath);
+
+	if (update->stagedPath)
+	{
+		DeleteFile (update->stagedPath);
+		free (update->stagedPath);
+		update->stagedPath = NULL;
+	}
+
+	//A finished patch was counted as downloaded for whatever it didn't get from the cache
+	//or a neighbour, a failed one as much as its partial download kept
+	LONG countedBytes = (LONG)GetPartialLength(update);
+
+	if (update->state == STATE_DOWNLOADED || update->state == STATE_STAGED)
+	{
+		InterlockedDecrement (&completedUpdates);
+		countedBytes = update->fileSize - update->skippedBytes;
+	}
+
+	//The patch is no use now, the full file goes to its own cache object
+	DiscardPartialDownload (update);
+	InterlockedExchangeAdd (&completedFileSize, -countedBytes);
+
+	free (update->sourceURL);
+	update->sourceURL = update->fullSourceURL;
+	update->fullSourceURL = NULL;
+
+	//Download workers may still be running and counting. Skipped bytes already came off the total.
+	InterlockedExchangeAdd (&totalFileSize, (LONG)update->fullFileSize - (LONG)(update->fileSize - update->skippedBytes));
+	update->fileSize = update->fullFileSize;
+	update->skippedBytes = 0;
+
+	memcpy (update->downloadhash, update->hash, sizeof(update->downloadhash));
+	SetCachePath (update);
+
+	update->patchable = 0;
+	update->attempts = 0;
+	update->errorCode = 0;
+	update->state = STATE_PENDING_DOWNLOAD;
+
+	//Anything waiting on the patch goes with it, the next download pass merges them again
+	while (update->duplicates)
+	{
+		update_t *duplicate = update->duplicates;
+
+		update->duplicates = duplicate->nextDuplicate;
+		duplicate->nextDuplicate = NULL;
+
+		//Not a patch of its own, it fetches the same object by itself and is counted again
+		if (!FallBackToFullDownload(duplicate))
+		{
+			InterlockedExchangeAdd (&totalFileSize, (LONG)duplicate->skippedBytes);
+			duplicate->skippedBytes = 0;
+			duplicate->state = STATE_PENDING_DOWNLOAD;
+		}
+	}
+
+	return TRUE;
+}
+
+//Puts a failed download back on our own queue after a backoff, or turns a
+//patch into a full download. FALSE once the file or the run is out of retries.
+static BOOL RetryDownload (int self, update_t *update, int responseCode)
+{
+	BOOL retryable = IsRetryable(responseCode);
+
+	if (!retryable && !update->patchable)
+		return FALSE;
+
+	if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0 || InterlockedDecrement(&retryBudget) < 0)
+		return FALSE;
+
+	update->attempts++;
+
+	if (update->patchable && (!retryable || update->attempts >= DOWNLOAD_MAX_ATTEMPTS))
+	{
+		if (!FallBackToFullDownload(update))
+			return FALSE;
+	}
+	else if (update->attempts >= DOWNLOAD_MAX_ATTEMPTS)
+	{
+		return FALSE;
+	}
+	else
+	{
+		//Anywhere between half and all of the backoff, so workers that failed together don't retry together
+		DWORD delay = min(DOWNLOAD_RETRY_BASE_MS << (update->attempts - 1), DOWNLOAD_RETRY_MAX_MS);
+		DWORD seed = GetTickCount() ^ (GetCurrentThreadId() * 2654435761u);
+
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		delay = delay / 2 + seed % (delay / 2 + 1);
+
+		Status (_T("Retrying %s in %u ms (error code %d)"), update->outputPath, delay, responseCode);
+		Log (_T("Retrying %s in %u ms, attempt %d (error code %d)"), update->outputPath, delay, update->attempts + 1, responseCode);
+
+		if (WaitForSingleObject(cancelRequested, delay) == WAIT_OBJECT_0)
+			return FALSE;
+
+		update->state = STATE_PENDING_DOWNLOAD;
+	}
+
+	download_queue_t *queue = &queues[self];
+
+	EnterCriticalSection (&queue->lock);
+	queue->items[queue->tail++] = update;
+	LeaveCriticalSection (&queue->lock);
+
+	return TRUE;
+}
+
+static DWORD WINAPI DownloadWorkerThread (VOID *arg)
+{
+	int self = (int)(INT_PTR)arg;
+	DWORD ret = 1;
+	update_t *update;
+
+	for (;;)
+	{
+		int responseCode;
+
+		//Out of files of our own, help with a large one before giving up
+		update = NextDownload(self);
+		if (!update)
+		{
+			if (HelpSegmentedDownload())
+				continue;
+
+			break;
+		}
+
+		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+			goto failure;
+
+		if (downloadThreadFailure)
+			goto failure;
+
+		update->state = STATE_DOWNLOADING;
+
+		Status (_T("Downloading %s"), update->outputPath);
+
+		//The download is hashed as it is written, so the temp file never has to be read back
+		hash_sink_t sink;
+		if (!HashSinkInit(&sink))
+		{
+			downloadThreadFailure = TRUE;
+			Status (_T("Update failed: Couldn't verify integrity of %s"), update->outputPath);
+			goto failure;
+		}
+
+		//A resumed download is requested without compression so the range lines up with the decoded bytes on disk
+		_TCHAR extraHeaders[64];
+		ULONGLONG resumeOffset = ResumePartialDownload(update, &sink);
+
+		if (resumeOffset)
+		{
+			StringCbPrintf(extraHeaders, sizeof(extraHeaders), _T("Range: bytes=%I64u-"), resumeOffset);
+			Log (_T("Resuming %s from %I64u bytes"), update->outputPath, resumeOffset);
+
+			//On a retry those bytes were already counted while the failed attempt wrote them
+			if (!update->attempts)
+				InterlockedExchangeAdd (&completedFileSize, (LONG)resumeOffset);
+		}
+		else
+		{
+			StringCbCopy(extraHeaders, sizeof(extraHeaders), _T("Accept-Encoding: gzip"));
+		}
+
+		DWORD networkStart = GetTickCount();
+
+		int segmented = SEGMENTED_UNSUPPORTED;
+		if ((ULONGLONG)update->fileSize >= resumeOffset + DOWNLOAD_SEGMENT_THRESHOLD)
+			segmented = DownloadSegmented(update, resumeOffset, &sink, &responseCode);
+
+		if (segmented == SEGMENTED_FAILED)
+		{
+			HashSinkFree (&sink);
+
+			if (RetryDownload(self, update, responseCode))
+				continue;
+
+			downloadThreadFailure = TRUE;
+			Status (_T("Update failed: Could not download %s (error code %d)"), update->outputPath, responseCode);
+			goto failure;
+		}
+
+		//Servers that don't do ranges get the whole file over one connection
+		if (segmented == SEGMENTED_UNSUPPORTED && !HTTPGetFile (update->sourceURL, update->downloadPath, extraHeaders, resumeOffset, &responseCode, &sink))
+		{
+			ULONGLONG length = sink.length;
+
+			HashSinkFree (&sink);
+
+			if (responseCode == -16)
+			{
+				DiscardPartialDownload (update);
+				InterlockedExchangeAdd (&completedFileSize, -(LONG)length);
+			}
+			else
+			{
+				SavePartialDownload (update, length);
+			}
+
+			if (RetryDownload(self, update, responseCode))
+				continue;
+
+			downloadThreadFailure = TRUE;
+			Status (_T("Update failed: Could not download %s (error code %d)"), update->outputPath, responseCode);
+			goto failure;
+		}
+
+		if (responseCode != 200 && responseCode != 206)
+		{
+			HashSinkFree (&sink);
+
+			//Nothing was written, so whatever we resumed from is still good unless the server rejected the range
+			if (responseCode == 416)
+			{
+				DiscardPartialDownload (update);
+				InterlockedExchangeAdd (&completedFileSize, -(LONG)resumeOffset);
+			}
+			else
+			{
+				SavePartialDownload (update, resumeOffset);
+			}
+
+			if (RetryDownload(self, update, responseCode))
+				continue;
+
+			downloadThreadFailure = TRUE;
+			Status (_T("Update failed: Could not download %s (error code %d)"), update->outputPath, responseCode);
+			goto failure;
+		}
+
+		BYTE downloadHash[20];
+		if (!HashSinkFinish(&sink, downloadHash))
+		{
+			downloadThreadFailure = TRUE;
+			DiscardPartialDownload (update);
+			Status (_T("Update failed: Couldn't verify integrity of %s"), update->outputPath);
+			goto failure;
+		}
+
+		//Corrupted on the way, starting over from scratch might still work
+		if (memcmp(update->downloadhash, downloadHash, 20))
+		{
+			DiscardPartialDownload (update);
+			InterlockedExchangeAdd (&completedFileSize, -(LONG)update->fileSize);
+
+			if (RetryDownload(self, update, 0))
+				continue;
+
+			downloadThreadFailure = TRUE;
+			Status (_T("Update failed: Integrity check failed on %s"), update->outputPath);
+			goto failure;
+		}
+
+		//What one connection manages on the wire, so backoff and the patch queue stay out of it.
+		//Other workers helped with a segmented file, its bytes weren't this connection's alone.
+		if (segmented != SEGMENTED_OK)
+		{
+			queues[self].networkBytes += update->fileSize - resumeOffset;
+			queues[self].networkMs += GetTickCount() - networkStart;
+		}
+
+		if (!PublishCachedDownload(update))
+		{
+			downloadThreadFailure = TRUE;
+			Status (_T("Update failed: Couldn't save %s"), update->outputPath);
+			goto failure;
+		}
+
+		update->state = STATE_DOWNLOADED;
+		InterlockedIncrement (&completedUpdates);
+
+		update_t *duplicates = CompleteDuplicates(update);
+
+		//Hand it straight to the patch pool, the install waits for all of them anyway
+		if (update->patchable && !QueuePatch(update))
+		{
+			downloadThreadFailure = TRUE;
+			goto failure;
+		}
+
+		for (update_t *duplicate = duplicates; duplicate; duplicate = duplicate->nextDuplicate)
+		{
+			if (duplicate->patchable && !QueuePatch(duplicate))
+			{
+				downloadThreadFailure = TRUE;
+				goto failure;
+			}
+		}
+	}
+
+	queues[self].finishTick = GetTickCount();
+
+	ret = 0;
+
+failure:
+	return ret;
+}
+
+BOOL RunDownloadWorkers (int num, update_t *updates)
+{
+	HANDLE handles[MAX_DOWNLOAD_THREADS];
+	update_t **items = NULL;
+	int running = 0;
+	int totalItems = 0;
+	LONGLONG totalBytes = 0;
+	BOOL growing = FALSE;
+	BOOL ret = FALSE;
+
+	//No thread count given, start small and add connections while they still pay off
+	if (num <= 0)
+	{
+		num = INITIAL_DOWNLOAD_THREADS;
+		growing = TRUE;
+	}
+
+	if (num > MAX_DOWNLOAD_THREADS)
+		num = MAX_DOWNLOAD_THREADS;
+
+	BOOL segmentable = FALSE;
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state != STATE_PENDING_DOWNLOAD)
+			continue;
+
+		totalItems++;
+		totalBytes += update->fileSize;
+
+		if (update->fileSize >= DOWNLOAD_SEGMENT_THRESHOLD)
+			segmentable = TRUE;
+	}
+
+	if (!totalItems)
+		return TRUE;
+
+	//Extra workers are still useful with few files if they can help with a large one
+	if (num > totalItems && !segmentable)
+		num = totalItems;
+
+	InitializeCriticalSection (&segmentLock);
+	InitializeConditionVariable (&segmentHelpersDone);
+	activeSegmented = NULL;
+
+	for (int i = 0; i < MAX_DOWNLOAD_THREADS; i++)
+	{
+		InitializeCriticalSection (&queues[i].lock);
+		queues[i].items = NULL;
+		queues[i].head = 0;
+		queues[i].tail = 0;
+		queues[i].plannedBytes = 0;
+		queues[i].finishTick = 0;
+		queues[i].networkBytes = 0;
+		queues[i].networkMs = 0;
+	}
+
+	items = (update_t **)malloc (sizeof(*items) * totalItems);
+	if (!items)
+		goto failure;
+
+	retryBudget = DOWNLOAD_RETRY_BUDGET;
+
+	//Retries go back on the end of the failing worker's queue, so every queue needs room for them
+	for (int i = 0; i < MAX_DOWNLOAD_THREADS; i++)
+	{
+		queues[i].items = (update_t **)malloc (sizeof(*queues[i].items) * (totalItems + DOWNLOAD_RETRY_BUDGET));
+		if (!queues[i].items)
+			goto failure;
+	}
+
+	int count = 0;
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (update->state == STATE_PENDING_DOWNLOAD)
+			items[count++] = update;
+	}
+
+	//Patches that fell back to the same full file would otherwise fetch it side by side
+	qsort (items, count, sizeof(*items), CompareDownloadHash);
+	LinkDuplicateDownloads (items, count);
+
+	int waiting = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (items[i]->state == STATE_WAITING)
+		{
+			totalBytes -= items[i]->fileSize;
+			waiting++;
+		}
+		else
+			items[i - waiting] = items[i];
+	}
+	count -= waiting;
+
+	LONGLONG plannedMakespan = PlanDownloads (items, count, num);
+	DWORD startTick = GetTickCount();
+
+	for (running = 0; running < num; running++)
+	{
+		handles[running] = CreateThread (NULL, 0, DownloadWorkerThread, (VOID *)(INT_PTR)running, 0, NULL);
+		if (!handles[running])
+		{
+			downloadThreadFailure = TRUE;
+			break;
+		}
+	}
+
+	//Per connection rate over the first sample interval, the makespan prediction can't use anything measured later
+	double firstRate = 0.0;
+
+	if (running)
+	{
+		LONG lastCompleted = completedFileSize;
+		DWORD lastTick = GetTickCount();
+		double lastRate = 0.0;
+
+		while (WaitForMultipleObjects (running, handles, TRUE, DOWNLOAD_SAMPLE_INTERVAL) == WAIT_TIMEOUT)
+		{
+			LONG completed = completedFileSize;
+			DWORD tick = GetTickCount();
+			double rate = (double)(completed - lastCompleted) / (double)max(tick - lastTick, 1);
+
+			lastCompleted = completed;
+			lastTick = tick;
+
+			if (firstRate == 0.0)
+				firstRate = rate / running;
+
+			if (!growing)
+				continue;
+
+			//Stop adding connections as soon as the last one didn't buy us at least 10% more throughput
+			if (running == MAX_DOWNLOAD_THREADS || rate < lastRate * 1.1 || (!DownloadsRemaining() && !SegmentsRemaining()))
+			{
+				growing = FALSE;
+				continue;
+			}
+
+			lastRate = rate;
+
+			handles[running] = CreateThread (NULL, 0, DownloadWorkerThread, (VOID *)(INT_PTR)running, 0, NULL);
+			if (handles[running])
+				running++;
+			else
+				growing = FALSE;
+		}
+	}
+
+	ret = !downloadThreadFailure;
+
+	for (int i = 0; i < running; i++)
+	{
+		DWORD exitCode;
+		if (!GetExitCodeThread (handles[i], &exitCode) || exitCode != 0)
+			ret = FALSE;
+
+		CloseHandle (handles[i]);
+	}
+
+	if (ret)
+	{
+		DWORD elapsed = max(GetTickCount() - startTick, 1);
+
+		Log (_T("Downloaded %d files (%I64d bytes) on %d connections"), count, totalBytes, running);
+
+		LONGLONG networkBytes = 0;
+		DWORD networkMs = 0;
+
+		for (int i = 0; i < running; i++)
+		{
+			networkBytes += queues[i].networkBytes;
+			networkMs += queues[i].networkMs;
+		}
+
+		RecordDownloadRate (networkBytes, networkMs);
+
+		//Predicted makespan assumes every initial connection keeps the rate of the first sample interval
+		if (firstRate > 0.0)
+		{
+			Log (_T("Largest worker plan: %I64d bytes (ideal %I64d), predicted makespan %u ms, actual %u ms"),
+				plannedMakespan, totalBytes / num, (DWORD)((double)plannedMakespan / firstRate), elapsed);
+		}
+		else
+		{
+			Log (_T("Largest worker plan: %I64d bytes (ideal %I64d), finished in %u ms before the first rate sample"),
+				plannedMakespan, totalBytes / num, elapsed);
+		}
+
+		for (int i = 0; i < running; i++)
+		{
+			if (queues[i].finishTick)
+				Log (_T("  worker %d finished after %u ms"), i, queues[i].finishTick - startTick);
+		}
+	}
+
+failure:
+	if (items)
+		free (items);
+
+	for (int i = 0; i < MAX_DOWNLOAD_THREADS; i++)
+	{
+		if (queues[i].items)
+			free (queues[i].items);
+
+		DeleteCriticalSection (&queues[i].lock);
+	}
+
+	DeleteCriticalSection (&segmentLock);
+
+	return ret;
+}
@@ -1,15 +1,108 @@
 #include "Updater.h"
 
-BOOL HTTPPostData(const _TCHAR *url, const BYTE *data, int dataLen, const _TCHAR *extraHeaders, int *responseCode, BYTE **response, int *responseLen)
+//Every request goes through one WinHTTP session and one connect handle per
+//host. WinHTTP keeps finished connections of a session alive and reuses their
+//TLS sessions, so later requests to the same host skip the handshake.
+typedef struct http_host_s
+{
+	struct http_host_s	*next;
+	_TCHAR				hostName[256];
+	INTERNET_PORT		port;
+	HINTERNET			hConnect;
+} http_host_t;
+
+static HINTERNET hSession;
+static http_host_t *hosts;
+static CRITICAL_SECTION poolMutex;
+static BOOL poolReady;
+
+BOOL HTTPInitPool (DWORD maxConnsPerHost)
+{
+	InitializeCriticalSection (&poolMutex);
+	poolReady = TRUE;
+
+	hSession = WinHttpOpen(_T("OBS Updater/2.1"), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+	if (!hSession)
+		return FALSE;
+
+	WinHttpSetOption (hSession, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &maxConnsPerHost, sizeof(maxConnsPerHost));
+	WinHttpSetOption (hSession, WINHTTP_OPTION_MAX_CONNS_PER_1_0_SERVER, &maxConnsPerHost, sizeof(maxConnsPerHost));
+
+	return TRUE;
+}
+
+VOID HTTPFreePool ()
+{
+	if (!poolReady)
+		return;
+
+	while (hosts)
+	{
+		http_host_t *next = hosts->next;
+
+		WinHttpCloseHandle (hosts->hConnect);
+		free (hosts);
+
+		hosts = next;
+	}
+
+	if (hSession)
+	{
+		WinHttpCloseHandle (hSession);
+		hSession = NULL;
+	}
+
+	DeleteCriticalSection (&poolMutex);
+	poolReady = FALSE;
+}
+
+static HINTERNET GetHostConnection (const _TCHAR *hostName, INTERNET_PORT port)
 {
-	HINTERNET hSession = NULL;
 	HINTERNET hConnect = NULL;
-	HINTERNET hRequest = NULL;
+	http_host_t *host;
+
+	EnterCriticalSection (&poolMutex);
+
+	for (host = hosts; host; host = host->next)
+	{
+		if (host->port == port && !_tcsicmp(host->hostName, hostName))
+			break;
+	}
+
+	if (!host && hSession)
+	{
+		host = (http_host_t *)malloc(sizeof(*host));
+		if (host)
+		{
+			host->hConnect = WinHttpConnect(hSession, hostName, port, 0);
+			if (host->hConnect)
+			{
+				StringCbCopy(host->hostName, sizeof(host->hostName), hostName);
+				host->port = port;
+				host->next = hosts;
+				hosts = host;
+			}
+			else
+			{
+				free (host);
+				host = NULL;
+			}
+		}
+	}
+
+	if (host)
+		hConnect = host->hConnect;
+
+	LeaveCriticalSection (&poolMutex);
+
+	return hConnect;
+}
+
+static HINTERNET OpenPooledRequest (const _TCHAR *url, const _TCHAR *verb, int *responseCode)
+{
 	URL_COMPONENTS urlComponents;
-	BOOL secure = FALSE;
-	BOOL ret = FALSE;
-	BYTE *responseBuffer = NULL;
-	BYTE *outputBuffer = NULL;
+	HINTERNET hConnect;
+	HINTERNET hRequest;
 
 	_TCHAR hostName[256];
 	_TCHAR path[1024];
@@ -19,7 +112,7 @@ BOOL HTTPPostData(const _TCHAR *url, const BYTE *data, int dataLen, const _TCHAR
 		NULL
 	};
 
-	ZeroMemory(&urlComponents, sizeof(urlComponents));
+	ZeroMemory (&urlComponents, sizeof(urlComponents));
 
 	urlComponents.dwStructSize = sizeof(urlComponents);
 
@@ -29,32 +122,42 @@ BOOL HTTPPostData(const _TCHAR *url, const BYTE *data, int dataLen, const _TCHAR
 	urlComponents.lpszUrlPath = path;
 	urlComponents.dwUrlPathLength = _countof(path);
 
-	WinHttpCrackUrl(url, 0, 0, &urlComponents);
-
-	if (urlComponents.nPort == 443)
-		secure = TRUE;
-
-	hSession = WinHttpOpen(_T("OBS Updater/2.1"), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
-	if (!hSession)
+	if (!WinHttpCrackUrl(url, 0, 0, &urlComponents))
 	{
 		*responseCode = -1;
-		goto failure;
+		return NULL;
 	}
 
-	hConnect = WinHttpConnect(hSession, hostName, secure ? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT, 0);
+	BOOL secure = (urlComponents.nScheme == INTERNET_SCHEME_HTTPS);
+
+	hConnect = GetHostConnection(hostName, urlComponents.nPort);
 	if (!hConnect)
 	{
 		*responseCode = -2;
-		goto failure;
+		return NULL;
 	}
 
-	hRequest = WinHttpOpenRequest(hConnect, TEXT("POST"), path, NULL, WINHTTP_NO_REFERER, acceptTypes, secure ? WINHTTP_FLAG_SECURE | WINHTTP_FLAG_REFRESH : WINHTTP_FLAG_REFRESH);
+	hRequest = WinHttpOpenRequest(hConnect, verb, path, NULL, WINHTTP_NO_REFERER, acceptTypes, secure ? WINHTTP_FLAG_SECURE|WINHTTP_FLAG_REFRESH : WINHTTP_FLAG_REFRESH);
 	if (!hRequest)
 	{
 		*responseCode = -3;
-		goto failure;
+		return NULL;
 	}
 
+	return hRequest;
+}
+
+static BOOL HTTPRequestData(const _TCHAR *verb, const _TCHAR *url, const BYTE *data, int dataLen, const _TCHAR *extraHeaders, int *responseCode, BYTE **response, int *responseLen)
+{
+	HINTERNET hRequest = NULL;
+	BOOL ret = FALSE;
+	BYTE *responseBuffer = NULL;
+	BYTE *outputBuffer = NULL;
+
+	hRequest = OpenPooledRequest(url, verb, responseCode);
+	if (!hRequest)
+		goto failure;
+
 	BOOL bResults = WinHttpSendRequest(hRequest, extraHeaders, extraHeaders ? -1 : 0, (LPVOID)data, dataLen, dataLen, 0);
 
 	// End the request.
@@ -232,55 +335,50 @@ failure:
 		free(responseBuffer);
 	if (outputBuffer)
 		free(outputBuffer);
-	if (hSession)
-		WinHttpCloseHandle(hSession);
-	if (hConnect)
-		WinHttpCloseHandle(hConnect);
 	if (hRequest)
 		WinHttpCloseHandle(hRequest);
 
 	return ret;
 }
 
-BOOL HTTPGetFile (HINTERNET hSession, HINTERNET hConnect, const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, int *responseCode)
+BOOL HTTPPostData(const _TCHAR *url, const BYTE *data, int dataLen, const _TCHAR *extraHeaders, int *responseCode, BYTE **response, int *responseLen)
 {
-	HINTERNET hRequest = NULL;
-	BOOL ret = FALSE;
-
-	BYTE *outputBuffer = NULL;
+	return HTTPRequestData(TEXT("POST"), url, data, dataLen, extraHeaders, responseCode, response, responseLen);
+}
 
-	const TCHAR *acceptTypes[] = {
-		TEXT("*/*"),
-		NULL
-	};
+//Small responses only, the whole body is kept in memory
+BOOL HTTPGetData(const _TCHAR *url, const _TCHAR *extraHeaders, int *responseCode, BYTE **response, int *responseLen)
+{
+	return HTTPRequestData(TEXT("GET"), url, NULL, 0, extraHeaders, responseCode, response, responseLen);
+}
 
-	URL_COMPONENTS urlComponents;
-	BOOL secure = FALSE;
+//A 206 is only useful if it starts where we asked, "bytes <start>-<end>/<total>"
+static BOOL RangeStartsAt (HINTERNET hRequest, ULONGLONG offset)
+{
+	TCHAR contentRange[128];
+	DWORD contentRangeLen = sizeof(contentRange);
 
-	_TCHAR hostName[256];
-	_TCHAR path[1024];
+	if (!WinHttpQueryHeaders (hRequest, WINHTTP_QUERY_CONTENT_RANGE, WINHTTP_HEADER_NAME_BY_INDEX, contentRange, &contentRangeLen, WINHTTP_NO_HEADER_INDEX))
+		return FALSE;
 
-	ZeroMemory (&urlComponents, sizeof(urlComponents));
+	contentRange[_countof(contentRange) - 1] = 0;
 
-	urlComponents.dwStructSize = sizeof(urlComponents);
-	
-	urlComponents.lpszHostName = hostName;
-	urlComponents.dwHostNameLength = _countof(hostName);
+	if (_tcsncmp(contentRange, _T("bytes "), 6) || contentRange[6] < '0' || contentRange[6] > '9')
+		return FALSE;
 
-	urlComponents.lpszUrlPath = path;
-	urlComponents.dwUrlPathLength = _countof(path);
+	return _tcstoui64(contentRange + 6, NULL, 10) == offset;
+}
 
-	WinHttpCrackUrl(url, 0, 0, &urlComponents);
+BOOL HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, ULONGLONG resumeOffset, int *responseCode, hash_sink_t *sink)
+{
+	HINTERNET hRequest = NULL;
+	BOOL ret = FALSE;
 
-	if (urlComponents.nPort == 443)
-		secure = TRUE;
+	BYTE *outputBuffer = NULL;
 
-	hRequest = WinHttpOpenRequest(hConnect, TEXT("GET"), path, NULL, WINHTTP_NO_REFERER, acceptTypes, secure ? WINHTTP_FLAG_SECURE|WINHTTP_FLAG_REFRESH : WINHTTP_FLAG_REFRESH);
+	hRequest = OpenPooledRequest(url, TEXT("GET"), responseCode);
 	if (!hRequest)
-	{
-		*responseCode = -3;
 		goto failure;
-	}
 
 	BOOL bResults = WinHttpSendRequest(hRequest, extraHeaders, extraHeaders ? -1 : 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0);
 
@@ -356,7 +454,14 @@ BOOL HTTPGetFile (HINTERNET hSession, HINTERNET hConnect, const _TCHAR *url, con
 
 	*responseCode = wcstoul(statusCode, NULL, 10);
 
-	if (bResults && *responseCode == 200)
+	//Partial content only makes sense appended to the bytes we asked to continue from, and those were stored decoded
+	if (bResults && *responseCode == 206 && (!resumeOffset || gzip || !RangeStartsAt(hRequest, resumeOffset)))
+	{
+		*responseCode = -16;
+		goto failure;
+	}
+
+	if (bResults && (*responseCode == 200 || *responseCode == 206))
 	{
 		BYTE buffer[32768];
 		DWORD dwSize, dwOutSize, wrote;
@@ -364,13 +469,43 @@ BOOL HTTPGetFile (HINTERNET hSession, HINTERNET hConnect, const _TCHAR *url, con
 		HANDLE updateFile;
 		int lastPosition = 0;
 
-		updateFile = CreateFile(outputPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+		updateFile = CreateFile(outputPath, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, 0, NULL);
 		if (updateFile == INVALID_HANDLE_VALUE)
 		{
 			*responseCode = -7;
 			goto failure;
 		}
 
+		LARGE_INTEGER offset;
+		offset.QuadPart = 0;
+
+		if (*responseCode == 206)
+		{
+			offset.QuadPart = resumeOffset;
+		}
+		else if (resumeOffset)
+		{
+			//The server ignored our range and sent the whole file, start over
+			if (sink)
+				HashSinkFree (sink);
+
+			if (sink && !HashSinkInit(sink))
+			{
+				*responseCode = -15;
+				CloseHandle (updateFile);
+				goto failure;
+			}
+
+			InterlockedExchangeAdd (&completedFileSize, -(LONG)resumeOffset);
+		}
+
+		if (!SetFilePointerEx(updateFile, offset, NULL, FILE_BEGIN) || !SetEndOfFile(updateFile))
+		{
+			*responseCode = -7;
+			CloseHandle (updateFile);
+			goto failure;
+		}
+
 		do 
 		{
 			// Check for available data.
@@ -424,7 +559,14 @@ BOOL HTTPGetFile (HINTERNET hSession, HINTERNET hConnect, const _TCHAR *url, con
 							goto failure;
 						}
 
-						completedFileSize += wrote;
+						if (sink && !HashSinkWrite(sink, outputBuffer, wrote))
+						{
+							*responseCode = -15;
+							CloseHandle (updateFile);
+							goto failure;
+						}
+
+						InterlockedExchangeAdd (&completedFileSize, wrote);
 					}
 					while (strm.avail_out == 0);
 				}
@@ -444,7 +586,14 @@ BOOL HTTPGetFile (HINTERNET hSession, HINTERNET hConnect, const _TCHAR *url, con
 						goto failure;
 					}
 
-					completedFileSize += dwOutSize;
+					if (sink && !HashSinkWrite(sink, buffer, dwOutSize))
+					{
+						*responseCode = -15;
+						CloseHandle (updateFile);
+						goto failure;
+					}
+
+					InterlockedExchangeAdd (&completedFileSize, dwOutSize);
 				}
 
 				int position = (int)(((float)completedFileSize / (float)totalFileSize) * 100.0f);
@@ -477,3 +626,276 @@ failure:
 
 	return ret;
 }
+
+//Fetches bytes [offset, offset + length) of url into hFile at the same offset.
+//Several of these can write into the same handle at once, each to its own range.
+//Progress counts the bytes as they arrive and drops them again if the range
+//fails, so callers only ever have to take back ranges that succeeded.
+BOOL HTTPGetRange (const _TCHAR *url, HANDLE hFile, ULONGLONG offset, ULONGLONG length, int *responseCode)
+{
+	HINTERNET hRequest = NULL;
+	ULONGLONG received = 0;
+	BOOL ret = FALSE;
+
+	_TCHAR rangeHeader[64];
+
+	StringCbPrintf(rangeHeader, sizeof(rangeHeader), _T("Range: bytes=%I64u-%I64u"), offset, offset + length - 1);
+
+	hRequest = OpenPooledRequest(url, TEXT("GET"), responseCode);
+	if (!hRequest)
+		goto failure;
+
+	if (!WinHttpSendRequest(hRequest, rangeHeader, -1, WINHTTP_NO_REQUEST_DATA, 0, 0, 0) || !WinHttpReceiveResponse(hRequest, NULL))
+	{
+		*responseCode = GetLastError ();
+		goto failure;
+	}
+
+	TCHAR encoding[64];
+	DWORD encodingLen;
+
+	TCHAR statusCode[8];
+	DWORD statusCodeLen;
+
+	statusCodeLen = sizeof(statusCode);
+	if (!WinHttpQueryHeaders (hRequest, WINHTTP_QUERY_STATUS_CODE, WINHTTP_HEADER_NAME_BY_INDEX, &statusCode, &statusCodeLen, WINHTTP_NO_HEADER_INDEX))
+	{
+		*responseCode = -4;
+		goto failure;
+	}
+	else
+	{
+		statusCode[_countof(statusCode) - 1] = 0;
+	}
+
+	encodingLen = sizeof(encoding);
+	if (!WinHttpQueryHeaders (hRequest, WINHTTP_QUERY_CONTENT_ENCODING, WINHTTP_HEADER_NAME_BY_INDEX, encoding, &encodingLen, WINHTTP_NO_HEADER_INDEX))
+	{
+		encoding[0] = 0;
+		if (GetLastError() != ERROR_WINHTTP_HEADER_NOT_FOUND)
+		{
+			*responseCode = -5;
+			goto failure;
+		}
+	}
+	else
+	{
+		encoding[_countof(encoding) - 1] = 0;
+	}
+
+	*responseCode = wcstoul(statusCode, NULL, 10);
+
+	//Anything but plain partial content means the server can't do ranges for us, let the caller decide what to do
+	if (*responseCode != 206)
+	{
+		ret = TRUE;
+		goto failure;
+	}
+
+	//Neither is a range that starts somewhere else, we'd write it to the wrong place
+	if (!RangeStartsAt(hRequest, offset))
+	{
+		*responseCode = -16;
+		ret = TRUE;
+		goto failure;
+	}
+
+	if (encoding[0] && _tcscmp(encoding, _T("identity")))
+	{
+		*responseCode = -16;
+		goto failure;
+	}
+
+	BYTE buffer[32768];
+	DWORD dwSize, dwOutSize, wrote;
+	int lastPosition = 0;
+
+	do
+	{
+		dwSize = 0;
+		if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+		{
+			*responseCode = -8;
+			goto failure;
+		}
+
+		dwSize = min(dwSize, sizeof(buffer));
+
+		if (!WinHttpReadData(hRequest, (LPVOID)buffer, dwSize, &dwOutSize))
+		{
+			*responseCode = -9;
+			goto failure;
+		}
+
+		if (!dwOutSize)
+			break;
+
+		if (received + dwOutSize > length)
+		{
+			*responseCode = -17;
+			goto failure;
+		}
+
+		OVERLAPPED ov;
+		ZeroMemory (&ov, sizeof(ov));
+		ov.Offset = (DWORD)(offset + received);
+		ov.OffsetHigh = (DWORD)((offset + received) >> 32);
+
+		if (!WriteFile(hFile, buffer, dwOutSize, &wrote, &ov) || wrote != dwOutSize)
+		{
+			*responseCode = -12;
+			goto failure;
+		}
+
+		received += dwOutSize;
+
+		InterlockedExchangeAdd (&completedFileSize, dwOutSize);
+
+		int position = (int)(((float)completedFileSize / (float)totalFileSize) * 100.0f);
+		if (position > lastPosition)
+		{
+			lastPosition = position;
+			SendDlgItemMessage (hwndMain, IDC_PROGRESS, PBM_SETPOS, position, 0);
+		}
+
+		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		{
+			*responseCode = -14;
+			goto failure;
+		}
+	} while (dwSize > 0);
+
+	if (received != length)
+	{
+		*responseCode = -17;
+		goto failure;
+	}
+
+	ret = TRUE;
+
+failure:
+	if (hRequest)
+		WinHttpCloseHandle(hRequest);
+
+	if (!ret && received)
+		InterlockedExchangeAdd (&completedFileSize, -(LONG)received);
+
+	return ret;
+}
+
+//POSTs data and hands the response body to callback as it arrives instead of
+//buffering it. The callback returns FALSE to abort the transfer.
+BOOL HTTPPostStream (const _TCHAR *url, const BYTE *data, int dataLen, int *responseCode, http_stream_callback_t callback, VOID *param)
+{
+	HINTERNET hRequest = NULL;
+	BOOL ret = FALSE;
+
+	hRequest = OpenPooledRequest(url, TEXT("POST"), responseCode);
+	if (!hRequest)
+		goto failure;
+
+	if (!WinHttpSendRequest(hRequest, WINHTTP_NO_ADDITIONAL_HEADERS, 0, (LPVOID)data, dataLen, dataLen, 0) || !WinHttpReceiveResponse(hRequest, NULL))
+	{
+		*responseCode = GetLastError ();
+		goto failure;
+	}
+
+	TCHAR encoding[64];
+	DWORD encodingLen;
+
+	TCHAR statusCode[8];
+	DWORD statusCodeLen;
+
+	statusCodeLen = sizeof(statusCode);
+	if (!WinHttpQueryHeaders (hRequest, WINHTTP_QUERY_STATUS_CODE, WINHTTP_HEADER_NAME_BY_INDEX, &statusCode, &statusCodeLen, WINHTTP_NO_HEADER_INDEX))
+	{
+		*responseCode = -4;
+		goto failure;
+	}
+	else
+	{
+		statusCode[_countof(statusCode) - 1] = 0;
+	}
+
+	encodingLen = sizeof(encoding);
+	if (!WinHttpQueryHeaders (hRequest, WINHTTP_QUERY_CONTENT_ENCODING, WINHTTP_HEADER_NAME_BY_INDEX, encoding, &encodingLen, WINHTTP_NO_HEADER_INDEX))
+	{
+		encoding[0] = 0;
+		if (GetLastError() != ERROR_WINHTTP_HEADER_NOT_FOUND)
+		{
+			*responseCode = -5;
+			goto failure;
+		}
+	}
+	else
+	{
+		encoding[_countof(encoding) - 1] = 0;
+	}
+
+	*responseCode = wcstoul(statusCode, NULL, 10);
+
+	if (*responseCode != 200)
+	{
+		ret = TRUE;
+		goto failure;
+	}
+
+	//We never ask for compression, the callback has to see the raw stream
+	if (encoding[0] && _tcscmp(encoding, _T("identity")))
+	{
+		*responseCode = -16;
+		goto failure;
+	}
+
+	BYTE buffer[32768];
+	DWORD dwSize, dwOutSize;
+	int lastPosition = 0;
+
+	do
+	{
+		dwSize = 0;
+		if (!WinHttpQueryDataAvailable(hRequest, &dwSize))
+		{
+			*responseCode = -8;
+			goto failure;
+		}
+
+		dwSize = min(dwSize, sizeof(buffer));
+
+		if (!WinHttpReadData(hRequest, (LPVOID)buffer, dwSize, &dwOutSize))
+		{
+			*responseCode = -9;
+			goto failure;
+		}
+
+		if (!dwOutSize)
+			break;
+
+		if (!callback(buffer, dwOutSize, param))
+		{
+			*responseCode = -18;
+			goto failure;
+		}
+
+		int position = (int)(((float)completedFileSize / (float)totalFileSize) * 100.0f);
+		if (position > lastPosition)
+		{
+			lastPosition = position;
+			SendDlgItemMessage (hwndMain, IDC_PROGRESS, PBM_SETPOS, position, 0);
+		}
+
+		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		{
+			*responseCode = -14;
+			goto failure;
+		}
+	} while (dwSize > 0);
+
+	ret = TRUE;
+
+failure:
+	if (hRequest)
+		WinHttpCloseHandle(hRequest);
+
+	return ret;
+}
@@ -1,5 +1,7 @@
 #include "Updater.h"
 
+volatile LONGLONG hashedBytes = 0;
+
 VOID HashToString (BYTE *in, TCHAR *out)
 {
 	const char alphabet[] = "0123456789abcdef";
@@ -24,28 +26,53 @@ VOID StringToHash (TCHAR *in, BYTE *out)
 	}
 }
 
-BOOL CalculateFileHash (TCHAR *path, BYTE *hash)
+BOOL HashSinkInit (hash_sink_t *sink)
 {
-	BYTE buff[65536];
-	HCRYPTHASH hHash;
+	sink->length = 0;
 
-	if (!CryptCreateHash(hProvider, CALG_SHA1, 0, 0, &hHash))
+	if (!CryptCreateHash(hProvider, CALG_SHA1, 0, 0, &sink->hHash))
+	{
+		sink->hHash = 0;
 		return FALSE;
+	}
 
-	HANDLE hFile;
+	return TRUE;
+}
 
-	hFile = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
-	if (hFile == INVALID_HANDLE_VALUE)
+BOOL HashSinkWrite (hash_sink_t *sink, const BYTE *data, DWORD len)
+{
+	if (!CryptHashData(sink->hHash, data, len, 0))
+		return FALSE;
+
+	sink->length += len;
+	return TRUE;
+}
+
+BOOL HashSinkFinish (hash_sink_t *sink, BYTE *hash)
+{
+	DWORD hashLength = 20;
+	BOOL ret = CryptGetHashParam(sink->hHash, HP_HASHVAL, hash, &hashLength, 0);
+
+	HashSinkFree (sink);
+	return ret;
+}
+
+VOID HashSinkFree (hash_sink_t *sink)
+{
+	if (sink->hHash)
 	{
-		if (GetLastError() == ERROR_FILE_NOT_FOUND)
-		{
-			//A missing file is OK
-			memset (hash, 0, 20);
-			return TRUE;
-		}
+		CryptDestroyHash(sink->hHash);
+		sink->hHash = 0;
+	}
+}
+
+BOOL CalculateHandleHash (HANDLE hFile, BYTE *hash)
+{
+	BYTE buff[65536];
+	hash_sink_t sink;
 
+	if (!HashSinkInit(&sink))
 		return FALSE;
-	}
 
 	for (;;)
 	{
@@ -53,27 +80,45 @@ BOOL CalculateFileHash (TCHAR *path, BYTE *hash)
 
 		if (!ReadFile(hFile, buff, sizeof(buff), &read, NULL))
 		{
-			CloseHandle (hFile);
+			HashSinkFree (&sink);
 			return FALSE;
 		}
 
 		if (!read)
 			break;
 
-		if (!CryptHashData(hHash, buff, read, 0))
+		if (!HashSinkWrite(&sink, buff, read))
 		{
-			CryptDestroyHash(hHash);
-			CloseHandle (hFile);
+			HashSinkFree (&sink);
 			return FALSE;
 		}
 	}
 
-	CloseHandle (hFile);
+	InterlockedExchangeAdd64 (&hashedBytes, sink.length);
+
+	return HashSinkFinish(&sink, hash);
+}
+
+BOOL CalculateFileHash (TCHAR *path, BYTE *hash)
+{
+	HANDLE hFile;
+
+	hFile = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		if (GetLastError() == ERROR_FILE_NOT_FOUND)
+		{
+			//A missing file is OK
+			memset (hash, 0, 20);
+			return TRUE;
+		}
 
-	DWORD hashLength = 20;
-	if (!CryptGetHashParam(hHash, HP_HASHVAL, hash, &hashLength, 0))
 		return FALSE;
+	}
 
-	CryptDestroyHash(hHash);
-	return TRUE;
+	BOOL ret = CalculateHandleHash(hFile, hash);
+
+	CloseHandle (hFile);
+
+	return ret;
 }
@@ -0,0 +1,370 @@
+#include "Updater.h"
+
+//Remembers the SHA-1 of every installed file we have hashed before, keyed by
+//its full path and validated against the size, last write time and file ID.
+//Anything that doesn't match exactly is hashed for real. Entries nobody looked
+//at this run are only kept while their file still exists.
+
+#define HASH_CACHE_MAGIC	"OBSHCv01"
+#define HASH_CACHE_BUCKETS	4096
+
+typedef struct hash_cache_entry_s
+{
+	struct hash_cache_entry_s *next;
+	_TCHAR		*path;
+	ULONGLONG	size;
+	ULONGLONG	lastWrite;
+	ULONGLONG	fileIndex;
+	DWORD		volume;
+	BYTE		hash[20];
+	BOOL		used;
+} hash_cache_entry_t;
+
+#pragma pack(push, r1, 1)
+
+typedef struct
+{
+	WORD		pathLength;
+	ULONGLONG	size;
+	ULONGLONG	lastWrite;
+	ULONGLONG	fileIndex;
+	DWORD		volume;
+	BYTE		hash[20];
+} hash_cache_record_t;
+
+#pragma pack(pop, r1)
+
+static hash_cache_entry_t *buckets[HASH_CACHE_BUCKETS];
+static CRITICAL_SECTION cacheMutex;
+static int cacheEntries;
+
+static DWORD HashPath (const _TCHAR *path)
+{
+	DWORD h = 2166136261u;
+
+	while (*path)
+	{
+		h ^= (DWORD)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static hash_cache_entry_t *FindEntry (const _TCHAR *path)
+{
+	hash_cache_entry_t *entry = buckets[HashPath(path) % HASH_CACHE_BUCKETS];
+
+	while (entry)
+	{
+		if (!_tcscmp(entry->path, path))
+			return entry;
+
+		entry = entry->next;
+	}
+
+	return NULL;
+}
+
+static hash_cache_entry_t *AddEntry (const _TCHAR *path)
+{
+	hash_cache_entry_t *entry = (hash_cache_entry_t *)malloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	entry->path = _tcsdup(path);
+	if (!entry->path)
+	{
+		free (entry);
+		return NULL;
+	}
+
+	DWORD bucket = HashPath(path) % HASH_CACHE_BUCKETS;
+
+	entry->next = buckets[bucket];
+	buckets[bucket] = entry;
+
+	entry->used = FALSE;
+
+	cacheEntries++;
+
+	return entry;
+}
+
+static VOID SetEntryInfo (hash_cache_entry_t *entry, const BY_HANDLE_FILE_INFORMATION *info, const BYTE *hash)
+{
+	entry->size = ((ULONGLONG)info->nFileSizeHigh << 32) | info->nFileSizeLow;
+	entry->lastWrite = ((ULONGLONG)info->ftLastWriteTime.dwHighDateTime << 32) | info->ftLastWriteTime.dwLowDateTime;
+	entry->fileIndex = ((ULONGLONG)info->nFileIndexHigh << 32) | info->nFileIndexLow;
+	entry->volume = info->dwVolumeSerialNumber;
+	memcpy (entry->hash, hash, sizeof(entry->hash));
+	entry->used = TRUE;
+}
+
+static BOOL EntryMatches (const hash_cache_entry_t *entry, const BY_HANDLE_FILE_INFORMATION *info)
+{
+	return entry->size == (((ULONGLONG)info->nFileSizeHigh << 32) | info->nFileSizeLow) &&
+		entry->lastWrite == (((ULONGLONG)info->ftLastWriteTime.dwHighDateTime << 32) | info->ftLastWriteTime.dwLowDateTime) &&
+		entry->fileIndex == (((ULONGLONG)info->nFileIndexHigh << 32) | info->nFileIndexLow) &&
+		entry->volume == info->dwVolumeSerialNumber;
+}
+
+static VOID StoreEntry (const _TCHAR *fullPath, const BY_HANDLE_FILE_INFORMATION *info, const BYTE *hash)
+{
+	EnterCriticalSection (&cacheMutex);
+
+	hash_cache_entry_t *entry = FindEntry(fullPath);
+	if (!entry)
+		entry = AddEntry(fullPath);
+
+	if (entry)
+		SetEntryInfo (entry, info, hash);
+
+	LeaveCriticalSection (&cacheMutex);
+}
+
+//Called once at startup, before any thread can touch the cache
+VOID InitHashCache ()
+{
+	InitializeCriticalSection (&cacheMutex);
+}
+
+BOOL LoadHashCache (const _TCHAR *cachePath)
+{
+	BYTE *data = NULL;
+	BOOL ret = FALSE;
+	DWORD read;
+	LARGE_INTEGER size;
+
+	HANDLE hFile = CreateFile(cachePath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (!GetFileSizeEx(hFile, &size) || size.QuadPart < 12 || size.QuadPart > 0x10000000)
+		goto failure;
+
+	data = (BYTE *)malloc((size_t)size.QuadPart);
+	if (!data)
+		goto failure;
+
+	if (!ReadFile(hFile, data, (DWORD)size.QuadPart, &read, NULL) || read != size.QuadPart)
+		goto failure;
+
+	if (memcmp(data, HASH_CACHE_MAGIC, 8))
+		goto failure;
+
+	DWORD count;
+	memcpy (&count, data + 8, sizeof(count));
+
+	DWORD position = 12;
+
+	for (DWORD i = 0; i < count; i++)
+	{
+		hash_cache_record_t record;
+		_TCHAR path[MAX_PATH];
+
+		if (position + sizeof(record) > read)
+			goto failure;
+
+		memcpy (&record, data + position, sizeof(record));
+		position += sizeof(record);
+
+		if (!record.pathLength || record.pathLength >= MAX_PATH || position + record.pathLength * sizeof(WCHAR) > read)
+			goto failure;
+
+		memcpy (path, data + position, record.pathLength * sizeof(WCHAR));
+		path[record.pathLength] = 0;
+		position += record.pathLength * sizeof(WCHAR);
+
+		hash_cache_entry_t *entry = FindEntry(path);
+		if (!entry)
+			entry = AddEntry(path);
+
+		if (!entry)
+			goto failure;
+
+		entry->size = record.size;
+		entry->lastWrite = record.lastWrite;
+		entry->fileIndex = record.fileIndex;
+		entry->volume = record.volume;
+		memcpy (entry->hash, record.hash, sizeof(entry->hash));
+	}
+
+	ret = TRUE;
+
+failure:
+	if (data)
+		free (data);
+
+	CloseHandle (hFile);
+
+	//A damaged cache is just thrown away, we'll rebuild it from real hashes
+	if (!ret)
+		FreeHashCache ();
+
+	return ret;
+}
+
+BOOL SaveHashCache (const _TCHAR *cachePath)
+{
+	_TCHAR tempCachePath[MAX_PATH];
+	BOOL ret = FALSE;
+	DWORD wrote;
+	DWORD count = 0;
+
+	//Files that were uninstalled or moved would otherwise stay in the cache forever
+	for (int i = 0; i < HASH_CACHE_BUCKETS; i++)
+	{
+		for (hash_cache_entry_t *entry = buckets[i]; entry; entry = entry->next)
+		{
+			if (!entry->used && GetFileAttributes(entry->path) == INVALID_FILE_ATTRIBUTES)
+				continue;
+
+			entry->used = TRUE;
+			count++;
+		}
+	}
+
+	StringCbPrintf(tempCachePath, sizeof(tempCachePath), _T("%s.tmp"), cachePath);
+
+	HANDLE hFile = CreateFile(tempCachePath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (!WriteFile(hFile, HASH_CACHE_MAGIC, 8, &wrote, NULL) || wrote != 8)
+		goto failure;
+
+	if (!WriteFile(hFile, &count, sizeof(count), &wrote, NULL) || wrote != sizeof(count))
+		goto failure;
+
+	for (int i = 0; i < HASH_CACHE_BUCKETS; i++)
+	{
+		for (hash_cache_entry_t *entry = buckets[i]; entry; entry = entry->next)
+		{
+			hash_cache_record_t record;
+
+			if (!entry->used)
+				continue;
+
+			record.pathLength = (WORD)_tcslen(entry->path);
+			record.size = entry->size;
+			record.lastWrite = entry->lastWrite;
+			record.fileIndex = entry->fileIndex;
+			record.volume = entry->volume;
+			memcpy (record.hash, entry->hash, sizeof(record.hash));
+
+			if (!WriteFile(hFile, &record, sizeof(record), &wrote, NULL) || wrote != sizeof(record))
+				goto failure;
+
+			if (!WriteFile(hFile, entry->path, record.pathLength * sizeof(WCHAR), &wrote, NULL) || wrote != record.pathLength * sizeof(WCHAR))
+				goto failure;
+		}
+	}
+
+	ret = TRUE;
+
+failure:
+	CloseHandle (hFile);
+
+	if (ret)
+		ret = MoveFileEx(tempCachePath, cachePath, MOVEFILE_REPLACE_EXISTING);
+
+	if (!ret)
+		DeleteFile (tempCachePath);
+
+	return ret;
+}
+
+VOID FreeHashCache ()
+{
+	for (int i = 0; i < HASH_CACHE_BUCKETS; i++)
+	{
+		hash_cache_entry_t *entry = buckets[i];
+
+		while (entry)
+		{
+			hash_cache_entry_t *next = entry->next;
+
+			free (entry->path);
+			free (entry);
+
+			entry = next;
+		}
+
+		buckets[i] = NULL;
+	}
+
+	cacheEntries = 0;
+}
+
+BOOL CalculateFileHashCached (TCHAR *path, BYTE *hash)
+{
+	_TCHAR fullPath[MAX_PATH];
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ret;
+
+	if (!GetFullPathName(path, _countof(fullPath), fullPath, NULL))
+		return CalculateFileHash(path, hash);
+
+	HANDLE hFile = CreateFile(fullPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		if (GetLastError() == ERROR_FILE_NOT_FOUND)
+		{
+			//A missing file is OK
+			memset (hash, 0, 20);
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	if (!GetFileInformationByHandle(hFile, &info))
+	{
+		ret = CalculateHandleHash(hFile, hash);
+		CloseHandle (hFile);
+		return ret;
+	}
+
+	EnterCriticalSection (&cacheMutex);
+
+	hash_cache_entry_t *entry = FindEntry(fullPath);
+	ret = (entry && EntryMatches(entry, &info));
+	if (ret)
+	{
+		memcpy (hash, entry->hash, 20);
+		entry->used = TRUE;
+	}
+
+	LeaveCriticalSection (&cacheMutex);
+
+	if (!ret)
+	{
+		ret = CalculateHandleHash(hFile, hash);
+		if (ret)
+			StoreEntry (fullPath, &info, hash);
+	}
+
+	CloseHandle (hFile);
+
+	return ret;
+}
+
+//Records a hash we already know, e.g. for a file we just installed and verified
+VOID StoreFileHash (TCHAR *path, const BYTE *hash)
+{
+	_TCHAR fullPath[MAX_PATH];
+	BY_HANDLE_FILE_INFORMATION info;
+
+	if (!GetFullPathName(path, _countof(fullPath), fullPath, NULL))
+		return;
+
+	HANDLE hFile = CreateFile(fullPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	if (GetFileInformationByHandle(hFile, &info))
+		StoreEntry (fullPath, &info, hash);
+
+	CloseHandle (hFile);
+}
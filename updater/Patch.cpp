@@ -9,7 +9,35 @@ struct bspatch_stream
 	int (*read)(const struct bspatch_stream* stream, void* buffer, int length);
 };
 
-int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* newp, int64_t newsize, struct bspatch_stream* stream);
+//Upper bound on what a single patch may keep in memory: half for the output
+//window, half for the view of the old file
+DWORD patchMemoryLimit = DEFAULT_PATCH_MEMORY_LIMIT;
+
+#define PATCH_DECODE_BUFFER		(256 * 1024)
+#define PATCH_VIEW_SIZE			(16 * 1024 * 1024)
+
+typedef struct
+{
+	HANDLE			hMapping;
+	int64_t			size;
+	const uint8_t	*view;
+	int64_t			viewStart;
+	int64_t			viewSize;
+	int64_t			viewLimit;
+	DWORD			granularity;
+} old_file_t;
+
+typedef struct
+{
+	HANDLE			hFile;
+	hash_sink_t		*sink;
+	uint8_t			*buffer;
+	DWORD			size;
+	DWORD			used;
+} new_file_t;
+
+int bspatch(old_file_t* old, new_file_t* newf, int64_t newsize, struct bspatch_stream* stream);
+
 
 static int64_t offtin(uint8_t *buf)
 {
@@ -29,13 +57,61 @@ static int64_t offtin(uint8_t *buf)
 	return y;
 }
 
-int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* newp, int64_t newsize, struct bspatch_stream* stream)
+static const add_bytes_t add_bytes = select_add_bytes();
+
+//Returns old[pos, pos+len), remapping the view of the old file if needed
+static const uint8_t *old_range(old_file_t* old, int64_t pos, int64_t len)
+{
+	if (old->view && pos >= old->viewStart && pos + len <= old->viewStart + old->viewSize)
+		return old->view + (pos - old->viewStart);
+
+	if (old->view)
+	{
+		UnmapViewOfFile(old->view);
+		old->view = NULL;
+	}
+
+	old->viewStart = pos - pos % old->granularity;
+	old->viewSize = old->size - old->viewStart;
+	if (old->viewSize > old->viewLimit)
+		old->viewSize = old->viewLimit;
+
+	old->view = (const uint8_t *)MapViewOfFile(old->hMapping, FILE_MAP_READ, (DWORD)(old->viewStart >> 32), (DWORD)old->viewStart, (SIZE_T)old->viewSize);
+	if (!old->view)
+		return NULL;
+
+	return old->view + (pos - old->viewStart);
+}
+
+static int flush_new(new_file_t* newf)
+{
+	DWORD wrote;
+
+	if (!newf->used)
+		return 0;
+
+	if (!WriteFile(newf->hFile, newf->buffer, newf->used, &wrote, NULL) || wrote != newf->used)
+		return -1;
+
+	if (!HashSinkWrite(newf->sink, newf->buffer, newf->used))
+		return -1;
+
+	newf->used = 0;
+	return 0;
+}
+
+int bspatch(old_file_t* old, new_file_t* newf, int64_t newsize, struct bspatch_stream* stream)
 {
 	uint8_t buf[8];
 	int64_t oldpos,newpos;
 	int64_t ctrl[3];
 	int64_t i;
 
+	//Largest piece we handle at once, so it always fits both the output window and one view of the old file
+	int64_t chunkLimit = newf->size;
+	if (chunkLimit > old->viewLimit - old->granularity)
+		chunkLimit = old->viewLimit - old->granularity;
+
 	oldpos=0;newpos=0;
 	while(newpos<newsize) {
 		/* Read control data */
@@ -46,125 +122,247 @@ int bspatch(const uint8_t* old, int64_t oldsize, uint8_t* newp, int64_t newsize,
 		};
 
 		/* Sanity-check */
-		if(newpos+ctrl[0]>newsize)
+		if(ctrl[0]<0 || ctrl[1]<0)
 			return -1;
 
-		/* Read diff string */
-		if (stream->read(stream, newp + newpos, ctrl[0]))
+		if(newpos+ctrl[0]>newsize)
 			return -1;
 
-		/* Add old data to diff string */
-		for(i=0;i<ctrl[0];i++)
-			if((oldpos+i>=0) && (oldpos+i<oldsize))
-				newp[newpos+i]+=old[oldpos+i];
+		/* Read diff string and add old data to it, one window at a time */
+		for(int64_t remaining=ctrl[0]; remaining>0;) {
+			int64_t chunk = min(remaining, min(chunkLimit, (int64_t)(newf->size - newf->used)));
+			uint8_t *dst = newf->buffer + newf->used;
 
-		/* Adjust pointers */
-		newpos+=ctrl[0];
-		oldpos+=ctrl[0];
+			if (stream->read(stream, dst, (int)chunk))
+				return -1;
+
+			/* Only the part of this chunk that overlaps the old file gets anything added */
+			int64_t lo = max(oldpos, (int64_t)0);
+			int64_t hi = min(oldpos + chunk, old->size);
+			if (lo < hi) {
+				const uint8_t *src = old_range(old, lo, hi - lo);
+				if (!src)
+					return -1;
+
+				add_bytes(dst + (lo - oldpos), src, (size_t)(hi - lo));
+			}
+
+			newf->used += (DWORD)chunk;
+			if (newf->used == newf->size && flush_new(newf))
+				return -1;
+
+			remaining-=chunk;
+			newpos+=chunk;
+			oldpos+=chunk;
+		}
 
 		/* Sanity-check */
 		if(newpos+ctrl[1]>newsize)
 			return -1;
 
 		/* Read extra string */
-		if (stream->read(stream, newp + newpos, ctrl[1]))
-			return -1;
+		for(int64_t remaining=ctrl[1]; remaining>0;) {
+			int64_t chunk = min(remaining, (int64_t)(newf->size - newf->used));
+
+			if (stream->read(stream, newf->buffer + newf->used, (int)chunk))
+				return -1;
+
+			newf->used += (DWORD)chunk;
+			if (newf->used == newf->size && flush_new(newf))
+				return -1;
+
+			remaining-=chunk;
+			newpos+=chunk;
+		}
 
 		/* Adjust pointers */
-		newpos+=ctrl[1];
 		oldpos+=ctrl[2];
 	};
 
-	return 0;
+	return flush_new(newf);
 }
 
-static int bz2_read(const struct bspatch_stream* stream, void* buffer, int length)
+//Feeds BZ2_bzDecompress straight from views of the mapped patch file and
+//hands out the result in large chunks, instead of going through FILE* and
+//BZ2_bzRead for every 8-byte control entry
+typedef struct
+{
+	HANDLE			hMapping;
+	int64_t			size;
+	int64_t			offset;
+	const uint8_t	*view;
+	DWORD			granularity;
+	bz_stream		bz;
+	BOOL			bzInit;
+	BOOL			finished;
+	uint8_t			buffer[PATCH_DECODE_BUFFER];
+	DWORD			pos;
+	DWORD			avail;
+} patch_reader_t;
+
+//Maps the next piece of compressed input
+static BOOL patch_map_next(patch_reader_t* reader)
 {
-	int n;
-	int bz2err;
-	BZFILE* bz2;
+	if (reader->view)
+	{
+		UnmapViewOfFile(reader->view);
+		reader->view = NULL;
+	}
 
-	bz2 = (BZFILE*)stream->opaque;
-	n = BZ2_bzRead(&bz2err, bz2, buffer, length);
-	if (n != length || bz2err < 0)
-		return -1;
+	if (reader->offset >= reader->size)
+		return FALSE;
+
+	int64_t start = reader->offset - reader->offset % reader->granularity;
+	int64_t length = min(reader->size - start, (int64_t)PATCH_VIEW_SIZE);
+
+	reader->view = (const uint8_t *)MapViewOfFile(reader->hMapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)length);
+	if (!reader->view)
+		return FALSE;
+
+	reader->bz.next_in = (char *)reader->view + (reader->offset - start);
+	reader->bz.avail_in = (unsigned int)(start + length - reader->offset);
+	reader->offset = start + length;
+
+	return TRUE;
+}
+
+//Decompresses until out is full or the stream ends, returns bytes produced or -1
+static int64_t patch_decompress(patch_reader_t* reader, uint8_t* out, DWORD length)
+{
+	reader->bz.next_out = (char *)out;
+	reader->bz.avail_out = length;
+
+	while (reader->bz.avail_out && !reader->finished)
+	{
+		BOOL lastInput = (reader->offset >= reader->size);
+
+		if (!reader->bz.avail_in && !lastInput && !patch_map_next(reader))
+			return -1;
+
+		unsigned int before = reader->bz.avail_out;
+
+		int bz2err = BZ2_bzDecompress(&reader->bz);
+		if (bz2err == BZ_STREAM_END)
+			reader->finished = TRUE;
+		else if (bz2err != BZ_OK)
+			return -1;
+		else if (lastInput && !reader->bz.avail_in && reader->bz.avail_out == before)
+			return -1; //truncated patch
+	}
+
+	return length - reader->bz.avail_out;
+}
+
+static int patch_read(const struct bspatch_stream* stream, void* buffer, int length)
+{
+	patch_reader_t* reader = (patch_reader_t*)stream->opaque;
+	uint8_t* out = (uint8_t*)buffer;
+
+	while (length > 0)
+	{
+		if (reader->pos == reader->avail)
+		{
+			//Big requests (diff and extra strings) decompress straight into the caller's buffer
+			if ((DWORD)length >= sizeof(reader->buffer))
+				return patch_decompress(reader, out, length) == length ? 0 : -1;
+
+			int64_t produced = patch_decompress(reader, reader->buffer, sizeof(reader->buffer));
+			if (produced <= 0)
+				return -1;
+
+			reader->pos = 0;
+			reader->avail = (DWORD)produced;
+		}
+
+		DWORD n = min((DWORD)length, reader->avail - reader->pos);
+
+		memcpy(out, reader->buffer + reader->pos, n);
+		reader->pos += n;
+		out += n;
+		length -= n;
+	}
 
 	return 0;
 }
 
-BOOL ApplyPatch(LPCTSTR patchFile, LPCTSTR targetFile)
+static VOID patch_close(patch_reader_t* reader)
+{
+	if (reader->bzInit)
+		BZ2_bzDecompressEnd(&reader->bz);
+
+	if (reader->view)
+		UnmapViewOfFile(reader->view);
+
+	if (reader->hMapping)
+		CloseHandle(reader->hMapping);
+
+	free(reader);
+}
+
+//Builds newFile from oldFile and the patch, hashing the result as it is written
+BOOL ApplyPatch(LPCTSTR patchFile, LPCTSTR oldFile, LPCTSTR newFile, BYTE *newHash)
 {
 	int ret = 1;
-	int bz2err;
 	uint8_t header[24];
 	int64_t newsize;
-	BZFILE* bz2;
+	patch_reader_t* reader = NULL;
+	LARGE_INTEGER patchFileSize;
 	struct bspatch_stream stream;
+	old_file_t old;
+	new_file_t newf;
+	SYSTEM_INFO info;
+	LARGE_INTEGER targetFileSize;
+	hash_sink_t sink = {0};
 
-	HANDLE hDest = INVALID_HANDLE_VALUE;
 	HANDLE hPatch = INVALID_HANDLE_VALUE;
 	HANDLE hTarget = INVALID_HANDLE_VALUE;
-	FILE *f = NULL;
 
-	uint8_t *old = NULL, *newData = NULL;
+	ZeroMemory (&old, sizeof(old));
+	ZeroMemory (&newf, sizeof(newf));
+	newf.hFile = INVALID_HANDLE_VALUE;
+	newf.sink = &sink;
 
-	hPatch = CreateFile (patchFile, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	hPatch = CreateFile (patchFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 	if (hPatch == INVALID_HANDLE_VALUE)
 	{
 		ret = GetLastError();
 		goto error;
 	}
 
-	hTarget = CreateFile (targetFile, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+	hTarget = CreateFile (oldFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
 	if (hTarget == INVALID_HANDLE_VALUE)
 	{
 		ret = GetLastError();
 		goto error;
 	}
 
-	//read patch header
-	DWORD read;
-	if (ReadFile (hPatch, header, sizeof(header), &read, NULL) && read == sizeof(header))
-	{
-		if (memcmp(header, "ENDSLEY/BSDIFF43", 16))
-		{
-			ret = -4;
-			goto error;
-		}
-	}
-	else
-	{
-		ret = GetLastError();
-		goto error;
-	}
-
-	//read patch new file size
-	newsize = offtin(header+16);
+	GetSystemInfo (&info);
 
-	if (newsize < 0 || newsize >= 0x7ffffffff)
+	//map the patch, the header and compressed data are read straight from the views
+	if (!GetFileSizeEx (hPatch, &patchFileSize))
 	{
-		ret = -5;
+		ret = GetLastError();
 		goto error;
 	}
 
-	//read current file data
-	DWORD targetFileSize;
-
-	targetFileSize = GetFileSize (hTarget, NULL);
-	if (targetFileSize == INVALID_FILE_SIZE)
+	if (patchFileSize.QuadPart < sizeof(header))
 	{
-		ret = GetLastError();
+		ret = -4;
 		goto error;
 	}
 
-	old = (uint8_t *)malloc (targetFileSize + 1);
-	if (!old)
+	reader = (patch_reader_t *)calloc(1, sizeof(*reader));
+	if (!reader)
 	{
 		ret = -6;
 		goto error;
 	}
 
-	if (!(ReadFile (hTarget, old, targetFileSize, &read, NULL) || read != targetFileSize))
+	reader->size = patchFileSize.QuadPart;
+	reader->granularity = info.dwAllocationGranularity;
+
+	reader->hMapping = CreateFileMapping (hPatch, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!reader->hMapping)
 	{
 		ret = GetLastError();
 		goto error;
@@ -173,70 +371,123 @@ BOOL ApplyPatch(LPCTSTR patchFile, LPCTSTR targetFile)
 	CloseHandle (hPatch);
 	hPatch = INVALID_HANDLE_VALUE;
 
-	CloseHandle (hTarget);
-	hTarget = INVALID_HANDLE_VALUE;
+	if (!patch_map_next(reader))
+	{
+		ret = GetLastError();
+		goto error;
+	}
 
-	//prepare new file
-	newData = (uint8_t *)malloc (newsize + 1);
+	//read patch header
+	memcpy (header, reader->bz.next_in, sizeof(header));
+	reader->bz.next_in += sizeof(header);
+	reader->bz.avail_in -= sizeof(header);
 
-	//open patch for bzip2
-	_tfopen_s (&f, patchFile, _T("rb"));
-	if (!f)
+	if (memcmp(header, "ENDSLEY/BSDIFF43", 16))
 	{
-		ret = -8;
+		ret = -4;
 		goto error;
 	}
 
-	_fseeki64(f, sizeof(header), SEEK_SET);
+	//read patch new file size
+	newsize = offtin(header+16);
 
-	if (NULL == (bz2 = BZ2_bzReadOpen(&bz2err, f, 0, 0, NULL, 0)))
+	if (newsize < 0 || newsize >= 0x7ffffffff)
+	{
+		ret = -5;
+		goto error;
+	}
+
+	if (BZ2_bzDecompressInit(&reader->bz, 0, 0) != BZ_OK)
 	{
 		ret = -10;
 		goto error;
 	}
 
-	stream.read = bz2_read;
-	stream.opaque = bz2;
+	reader->bzInit = TRUE;
 
-	//actually patch the data
-	if (bspatch(old, targetFileSize, newData, newsize, &stream))
+	//map the current file instead of reading it all in
+	if (!GetFileSizeEx (hTarget, &targetFileSize))
 	{
-		ret = -9;
+		ret = GetLastError();
 		goto error;
 	}
 
-	BZ2_bzReadClose(&bz2err, bz2);
+	old.size = targetFileSize.QuadPart;
+	old.granularity = info.dwAllocationGranularity;
+	old.viewLimit = max((int64_t)(patchMemoryLimit / 2), (int64_t)old.granularity * 4);
+	old.viewLimit -= old.viewLimit % old.granularity;
 
-	fclose(f);
-	f = NULL;
+	if (old.size)
+	{
+		old.hMapping = CreateFileMapping (hTarget, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!old.hMapping)
+		{
+			ret = GetLastError();
+			goto error;
+		}
+	}
 
-	//write new file
-	DWORD wrote;
+	//prepare new file, written out one window at a time
+	newf.size = (DWORD)min((int64_t)max(patchMemoryLimit / 2, 65536), newsize + 1);
+	newf.buffer = (uint8_t *)malloc (newf.size);
+	if (!newf.buffer)
+	{
+		ret = -6;
+		goto error;
+	}
 
-	hDest = CreateFile(targetFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
-	if (hDest == INVALID_HANDLE_VALUE)
+	if (!HashSinkInit(&sink))
 	{
-		ret = GetLastError();
+		ret = -11;
 		goto error;
 	}
 
-	if (!WriteFile(hDest, newData, newsize, &wrote, NULL) || wrote != newsize)
+	newf.hFile = CreateFile(newFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (newf.hFile == INVALID_HANDLE_VALUE)
 	{
 		ret = GetLastError();
 		goto error;
 	}
 
-	CloseHandle(hDest);
+	stream.read = patch_read;
+	stream.opaque = reader;
+
+	//actually patch the data
+	if (bspatch(&old, &newf, newsize, &stream))
+	{
+		ret = -9;
+		goto error;
+	}
+
+	if (!HashSinkFinish(&sink, newHash))
+	{
+		ret = -11;
+		goto error;
+	}
 
 	ret = 0;
 
 error:
 
-	if (old)
-		free (old);
+	if (reader)
+		patch_close (reader);
+
+	if (newf.hFile != INVALID_HANDLE_VALUE)
+		CloseHandle (newf.hFile);
+
+	if (newf.buffer)
+		free (newf.buffer);
+
+	HashSinkFree (&sink);
 
-	if (newData)
-		free (newData);
+	if (ret)
+		DeleteFile (newFile);
+
+	if (old.view)
+		UnmapViewOfFile (old.view);
+
+	if (old.hMapping)
+		CloseHandle (old.hMapping);
 
 	if (hTarget != INVALID_HANDLE_VALUE)
 		CloseHandle (hTarget);
@@ -244,9 +495,336 @@ error:
 	if (hPatch != INVALID_HANDLE_VALUE)
 		CloseHandle (hPatch);
 
-	if (f)
-		fclose (f);
-
 	return ret;
 }
 
+BOOL GetPatchNewSize(LPCTSTR patchFile, LONGLONG *newSize)
+{
+	uint8_t header[24];
+	DWORD read;
+
+	HANDLE hPatch = CreateFile (patchFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hPatch == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	BOOL ret = ReadFile (hPatch, header, sizeof(header), &read, NULL) && read == sizeof(header) && !memcmp(header, "ENDSLEY/BSDIFF43", 16);
+
+	CloseHandle (hPatch);
+
+	if (ret)
+		*newSize = offtin(header+16);
+
+	return ret && *newSize >= 0;
+}
+
+//-------------------------------
+//Parallel patching
+//-------------------------------
+
+typedef struct patch_job_s
+{
+	struct patch_job_s *next;
+	update_t	*update;
+	ULONGLONG	memory;
+	LONGLONG	newSize;
+} patch_job_t;
+
+//Patches downloaded patchable files into <outputPath>.new on a worker pool
+//while the remaining downloads carry on. A job is only started once its
+//predicted peak memory fits the budget next to the jobs already running.
+//Nothing in the install is touched here.
+static work_pool_t patchPool;
+static BOOL patchPoolActive;
+
+//Jobs wait here until their memory fits next to what's running
+static CRITICAL_SECTION admissionMutex;
+static CONDITION_VARIABLE patchesIdle;
+static patch_job_t *pendingHead;
+static patch_job_t *pendingTail;
+static ULONGLONG admissionInFlight;
+
+//What ApplyPatch will hold at once: both files up to the memory limit, plus bzip2 state and decode buffers
+static ULONGLONG PredictPatchMemory(ULONGLONG oldSize, ULONGLONG newSize)
+{
+	return min(oldSize + newSize, (ULONGLONG)patchMemoryLimit) + PATCH_OVERHEAD;
+}
+
+static ULONGLONG patchBudget;
+static ULONGLONG patchPeak;
+static int patchJobs;
+
+//Takes every pending job that fits the budget off the list, chained through
+//next. A large job doesn't hold up smaller ones queued behind it, and always
+//gets to run on its own even if it's over budget. Call with admissionMutex held.
+static patch_job_t *AdmitPendingPatches()
+{
+	patch_job_t *admitted = NULL;
+	patch_job_t *prev = NULL;
+	patch_job_t *job = pendingHead;
+
+	while (job)
+	{
+		patch_job_t *next = job->next;
+
+		//No room left for even the smallest job
+		if (admissionInFlight && admissionInFlight + PATCH_OVERHEAD > patchBudget)
+			break;
+
+		if (admissionInFlight && admissionInFlight + job->memory > patchBudget)
+		{
+			prev = job;
+			job = next;
+			continue;
+		}
+
+		if (prev)
+			prev->next = next;
+		else
+			pendingHead = next;
+
+		if (pendingTail == job)
+			pendingTail = prev;
+
+		admissionInFlight += job->memory;
+		patchPeak = max(patchPeak, admissionInFlight);
+		patchJobs++;
+
+		job->next = admitted;
+		admitted = job;
+		job = next;
+	}
+
+	return admitted;
+}
+
+static VOID CALLBACK PatchWorker(PTP_CALLBACK_INSTANCE instance, VOID *arg);
+
+//Outside admissionMutex, the pool may run them inline
+static VOID DispatchPatches(patch_job_t *admitted)
+{
+	while (admitted)
+	{
+		patch_job_t *next = admitted->next;
+
+		admitted->next = NULL;
+		QueueWork (&patchPool, PatchWorker, admitted);
+		admitted = next;
+	}
+}
+
+//Runs its job, then admits everything the memory it frees lets in. It keeps one
+//of those for itself and hands the rest to the pool, so a backlog spreads over
+//the threads again. The last worker to finish always admits the next job, so
+//the list drains without anybody having to wait for room.
+static VOID CALLBACK PatchWorker(PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	patch_job_t *job = (patch_job_t *)arg;
+
+	while (job)
+	{
+		update_t *update = job->update;
+		BYTE patchedHash[20];
+
+		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		{
+			update->errorCode = ERROR_CANCELLED;
+		}
+		else
+		{
+			DWORD startTick = GetTickCount();
+
+			update->errorCode = ApplyPatch(update->tempPath, update->outputPath, update->stagedPath, patchedHash);
+
+			if (!update->errorCode && memcmp(update->hash, patchedHash, 20))
+			{
+				DeleteFile (update->stagedPath);
+				update->errorCode = PATCH_ERROR_HASH_MISMATCH;
+			}
+
+			if (!update->errorCode)
+			{
+				update->state = STATE_STAGED;
+				RecordPatchRate (job->newSize, GetTickCount() - startTick);
+			}
+		}
+
+		EnterCriticalSection (&admissionMutex);
+		admissionInFlight -= job->memory;
+		free (job);
+		job = AdmitPendingPatches();
+
+		//Nothing running means nothing pending either, StopPatchWorkers can close the pool
+		if (!admissionInFlight)
+			WakeAllConditionVariable (&patchesIdle);
+
+		LeaveCriticalSection (&admissionMutex);
+
+		if (job)
+		{
+			DispatchPatches (job->next);
+			job->next = NULL;
+		}
+	}
+}
+
+BOOL StartPatchWorkers ()
+{
+	MEMORYSTATUSEX mem;
+
+	patchBudget = patchMemoryLimit + PATCH_OVERHEAD;
+	patchPeak = 0;
+	patchJobs = 0;
+
+	mem.dwLength = sizeof(mem);
+	if (GlobalMemoryStatusEx(&mem))
+		patchBudget = max(patchBudget, min(mem.ullAvailPhys, mem.ullAvailVirtual) / 2);
+
+	InitializeCriticalSection (&admissionMutex);
+	InitializeConditionVariable (&patchesIdle);
+	pendingHead = NULL;
+	pendingTail = NULL;
+	admissionInFlight = 0;
+
+	CreateWorkPool (&patchPool, GetCoreCount());
+	patchPoolActive = TRUE;
+
+	return TRUE;
+}
+
+//Called from the download workers as each patch verifies, never waits for memory
+BOOL QueuePatch (update_t *update)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	LONGLONG newSize;
+	_TCHAR stagedPath[MAX_PATH];
+
+	if (!GetFileAttributesEx(update->outputPath, GetFileExInfoStandard, &attributes))
+	{
+		//Uh oh, we thought we could patch something but it's no longer there!
+		Status(_T("Update failed: Source file %s not found"), update->outputPath);
+		return FALSE;
+	}
+
+	if (!GetPatchNewSize(update->tempPath, &newSize))
+	{
+		Status(_T("Update failed: Couldn't read patch for %s"), update->outputPath);
+		return FALSE;
+	}
+
+	StringCbPrintf(stagedPath, sizeof(stagedPath), _T("%s.new"), update->outputPath);
+
+	patch_job_t *job = (patch_job_t *)malloc(sizeof(*job));
+	update->stagedPath = _tcsdup(stagedPath);
+	if (!job || !update->stagedPath)
+	{
+		if (job)
+			free (job);
+
+		Status(_T("Update failed: Could not allocate memory for %s"), update->outputPath);
+		return FALSE;
+	}
+
+	job->next = NULL;
+	job->update = update;
+	job->newSize = newSize;
+	job->memory = PredictPatchMemory(((ULONGLONG)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow, newSize);
+
+	EnterCriticalSection (&admissionMutex);
+
+	if (pendingTail)
+		pendingTail->next = job;
+	else
+		pendingHead = job;
+	pendingTail = job;
+
+	//Whatever doesn't fit now is picked up by a worker as soon as memory frees up
+	patch_job_t *admitted = AdmitPendingPatches();
+
+	LeaveCriticalSection (&admissionMutex);
+
+	DispatchPatches (admitted);
+
+	return TRUE;
+}
+
+//Everything that was already downloaded before the download workers started
+BOOL QueueDownloadedPatches (update_t *updates)
+{
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (!update->patchable || update->state != STATE_DOWNLOADED || update->stagedPath)
+			continue;
+
+		if (!QueuePatch(update))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Waits for every queued patch, safe to call when nothing was started
+VOID StopPatchWorkers ()
+{
+	if (!patchPoolActive)
+		return;
+
+	//Workers hand jobs to the pool themselves, it can't be closed while they still might
+	EnterCriticalSection (&admissionMutex);
+	while (admissionInFlight)
+		SleepConditionVariableCS (&patchesIdle, &admissionMutex, INFINITE);
+	LeaveCriticalSection (&admissionMutex);
+
+	FinishWorkPool (&patchPool);
+
+	//Only left over if the pool never got to run at all
+	while (pendingHead)
+	{
+		patch_job_t *job = pendingHead;
+
+		pendingHead = job->next;
+		job->update->errorCode = ERROR_CANCELLED;
+		free (job);
+	}
+
+	pendingTail = NULL;
+
+	DeleteCriticalSection (&admissionMutex);
+
+	patchPoolActive = FALSE;
+}
+
+//Patches that didn't apply go back to STATE_PENDING_DOWNLOAD as full
+//downloads, the caller has to run the download workers again for those
+BOOL FinishPatchWorkers (update_t *updates)
+{
+	StopPatchWorkers ();
+
+	Log (_T("Patched %d files, peak predicted memory %I64u of %I64u byte budget"), patchJobs, patchPeak, patchBudget);
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (!update->patchable)
+			continue;
+
+		//A file in use or a cancel would stop the full download just the same
+		BOOL recoverable = update->errorCode && update->errorCode != ERROR_SHARING_VIOLATION && update->errorCode != ERROR_CANCELLED;
+
+		if (recoverable && FallBackToFullDownload(update))
+			continue;
+
+		if (update->errorCode == PATCH_ERROR_HASH_MISMATCH)
+			Status(_T("Update failed: Integrity check of patched %s failed"), update->outputPath);
+		else if (update->errorCode == ERROR_SHARING_VIOLATION)
+			Status(_T("Update failed: %s is still in use. Close all programs and try again."), update->outputPath);
+		else if (update->errorCode)
+			Status(_T("Update failed: Couldn't update %s (error %d)"), update->outputPath, update->errorCode);
+		else if (update->state != STATE_STAGED)
+			Status(_T("Update failed: %s was never patched"), update->outputPath);
+		else
+			continue;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
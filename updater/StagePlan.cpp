@@ -0,0 +1,289 @@
+#include "Updater.h"
+
+//A staged update is everything a normal run does short of touching the
+//install: downloads verified in the cache, patches applied to <file>.new.
+//The plan records which files were staged and what the install looked like
+//at the time, so the apply run only has to check nothing moved and swap
+//files in. Little endian:
+//	"OBSPLN02", manifest SHA-1, install directory, DWORD count, then entries
+//	of DWORD flags, new SHA-1, installed SHA-1, download SHA-1, output path.
+//Strings are a WORD length in characters followed by the characters.
+//Apply runs elevated and the plan is writable by the user, so it never names
+//a source: those are always the cache object and <output>.new, and the new
+//hash always comes from the manifest.
+
+#define STAGE_PLAN_MAGIC	"OBSPLN02"
+
+#define PLAN_PATCHABLE		0x1
+#define PLAN_HAS_HASH		0x2
+
+#pragma pack(push, r1, 1)
+
+typedef struct
+{
+	DWORD		flags;
+	BYTE		hash[20];
+	BYTE		my_hash[20];
+	BYTE		downloadhash[20];
+} plan_entry_t;
+
+#pragma pack(pop, r1)
+
+typedef struct
+{
+	plan_entry_t	entry;
+	_TCHAR			*outputPath;
+} plan_item_t;
+
+static int __cdecl ComparePlanItems (const void *a, const void *b)
+{
+	return _tcsicmp(((const plan_item_t *)a)->outputPath, ((const plan_item_t *)b)->outputPath);
+}
+
+static BOOL WritePlanData (HANDLE hFile, const VOID *data, DWORD length)
+{
+	DWORD wrote;
+	return WriteFile(hFile, data, length, &wrote, NULL) && wrote == length;
+}
+
+static BOOL WritePlanString (HANDLE hFile, const _TCHAR *str)
+{
+	WORD length = str ? (WORD)_tcslen(str) : 0;
+
+	return WritePlanData(hFile, &length, sizeof(length)) && WritePlanData(hFile, str, length * sizeof(_TCHAR));
+}
+
+static BOOL ReadPlanData (HANDLE hFile, VOID *data, DWORD length)
+{
+	DWORD read;
+	return ReadFile(hFile, data, length, &read, NULL) && read == length;
+}
+
+static _TCHAR *ReadPlanString (HANDLE hFile)
+{
+	WORD length;
+
+	if (!ReadPlanData(hFile, &length, sizeof(length)) || length >= MAX_PATH)
+		return NULL;
+
+	_TCHAR *str = (_TCHAR *)malloc((length + 1) * sizeof(_TCHAR));
+	if (!str)
+		return NULL;
+
+	if (!ReadPlanData(hFile, str, length * sizeof(_TCHAR)))
+	{
+		free (str);
+		return NULL;
+	}
+
+	str[length] = 0;
+	return str;
+}
+
+BOOL SaveStagePlan (const _TCHAR *path, const BYTE *manifestHash, update_t *updates)
+{
+	_TCHAR installDir[MAX_PATH];
+	_TCHAR tempPath[MAX_PATH];
+	DWORD count = 0;
+	BOOL ret;
+
+	if (!GetCurrentDirectory(_countof(installDir), installDir))
+		return FALSE;
+
+	for (update_t *update = updates->next; update; update = update->next)
+		count++;
+
+	//Written aside and renamed, an apply run never sees half a plan
+	StringCbPrintf(tempPath, sizeof(tempPath), _T("%s.tmp"), path);
+
+	HANDLE hFile = CreateFile(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	ret = WritePlanData(hFile, STAGE_PLAN_MAGIC, sizeof(STAGE_PLAN_MAGIC) - 1) &&
+		WritePlanData(hFile, manifestHash, 20) &&
+		WritePlanString(hFile, installDir) &&
+		WritePlanData(hFile, &count, sizeof(count));
+
+	for (update_t *update = updates->next; ret && update; update = update->next)
+	{
+		plan_entry_t entry;
+
+		entry.flags = (update->patchable ? PLAN_PATCHABLE : 0) | (update->has_hash ? PLAN_HAS_HASH : 0);
+		memcpy (entry.hash, update->hash, 20);
+		memcpy (entry.my_hash, update->my_hash, 20);
+		memcpy (entry.downloadhash, update->downloadhash, 20);
+
+		ret = WritePlanData(hFile, &entry, sizeof(entry)) &&
+			WritePlanString(hFile, update->outputPath);
+	}
+
+	CloseHandle (hFile);
+
+	if (!ret || !MoveFileEx(tempPath, path, MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFile (tempPath);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+//Matches the plan against the updates the manifest asks for and fills in
+//what was staged for each. Fails if the plan was made for a different
+//install or manifest, or doesn't cover exactly those updates.
+BOOL LoadStagePlan (const _TCHAR *path, const BYTE *manifestHash, update_t *updates, int *count)
+{
+	_TCHAR installDir[MAX_PATH];
+	_TCHAR stagedPath[MAX_PATH];
+	_TCHAR *planDir = NULL;
+	plan_item_t *items = NULL;
+	char magic[sizeof(STAGE_PLAN_MAGIC) - 1];
+	BYTE planManifestHash[20];
+	DWORD numEntries = 0;
+	DWORD numUpdates = 0;
+	BOOL ret = FALSE;
+
+	*count = 0;
+
+	if (!GetCurrentDirectory(_countof(installDir), installDir))
+		return FALSE;
+
+	HANDLE hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (!ReadPlanData(hFile, magic, sizeof(magic)) || memcmp(magic, STAGE_PLAN_MAGIC, sizeof(magic)))
+		goto failure;
+
+	if (!ReadPlanData(hFile, planManifestHash, sizeof(planManifestHash)) || memcmp(planManifestHash, manifestHash, 20))
+	{
+		Log (_T("Staged update was made for a different manifest"));
+		goto failure;
+	}
+
+	planDir = ReadPlanString(hFile);
+	if (!planDir || _tcsicmp(planDir, installDir))
+	{
+		Log (_T("Staged update was made for a different install"));
+		goto failure;
+	}
+
+	for (update_t *update = updates->next; update; update = update->next)
+		numUpdates++;
+
+	if (!ReadPlanData(hFile, &numEntries, sizeof(numEntries)))
+		goto failure;
+
+	if (numEntries != numUpdates)
+	{
+		Log (_T("Staged update is stale: %u files staged, %u need updating"), numEntries, numUpdates);
+		goto failure;
+	}
+
+	items = (plan_item_t *)calloc(numEntries + 1, sizeof(*items));
+	if (!items)
+		goto failure;
+
+	for (DWORD i = 0; i < numEntries; i++)
+	{
+		if (!ReadPlanData(hFile, &items[i].entry, sizeof(items[i].entry)))
+			goto failure;
+
+		items[i].outputPath = ReadPlanString(hFile);
+		if (!items[i].outputPath)
+			goto failure;
+	}
+
+	qsort (items, numEntries, sizeof(*items), ComparePlanItems);
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		plan_item_t key;
+
+		key.outputPath = update->outputPath;
+
+		plan_item_t *item = (plan_item_t *)bsearch(&key, items, numEntries, sizeof(*items), ComparePlanItems);
+		if (!item || memcmp(item->entry.hash, update->hash, 20))
+		{
+			Log (_T("Staged update is stale: %s wasn't staged for this manifest"), update->outputPath);
+			goto failure;
+		}
+
+		BOOL has_hash = (item->entry.flags & PLAN_HAS_HASH) != 0;
+
+		if (has_hash != update->has_hash || (has_hash && memcmp(item->entry.my_hash, update->my_hash, 20)))
+		{
+			Log (_T("Staged update is stale: %s changed since it was staged"), update->outputPath);
+			goto failure;
+		}
+
+		//Only the patch hash comes from the plan, it just picks which cache object to touch
+		update->patchable = (item->entry.flags & PLAN_PATCHABLE) != 0;
+		if (update->patchable)
+		{
+			memcpy (update->downloadhash, item->entry.downloadhash, 20);
+
+			StringCbPrintf(stagedPath, sizeof(stagedPath), _T("%s.new"), update->outputPath);
+			update->stagedPath = _tcsdup(stagedPath);
+			if (!update->stagedPath)
+				goto failure;
+		}
+
+		SetCachePath (update);
+		update->state = update->patchable ? STATE_STAGED : STATE_DOWNLOADED;
+
+		(*count)++;
+	}
+
+	ret = TRUE;
+
+failure:
+	if (planDir)
+		free (planDir);
+
+	if (items)
+	{
+		for (DWORD i = 0; i < numEntries; i++)
+		{
+			if (items[i].outputPath)
+				free (items[i].outputPath);
+		}
+
+		free (items);
+	}
+
+	CloseHandle (hFile);
+
+	return ret;
+}
+
+//The install has to be exactly what it was when we staged, and everything we
+//staged still has to be there untouched: the cache is shared and may have
+//been trimmed or rewritten since. Sources are hashed in full against the
+//manifest, never through the hash cache the user could have seeded.
+BOOL VerifyStagePlan (update_t *updates)
+{
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		BYTE hash[20];
+		BOOL has_hash = CalculateFileHashCached(update->outputPath, hash);
+
+		if (has_hash != update->has_hash || (has_hash && memcmp(hash, update->my_hash, 20)))
+		{
+			Log (_T("Staged update is stale: %s changed since it was staged"), update->outputPath);
+			return FALSE;
+		}
+
+		_TCHAR *source = update->patchable ? update->stagedPath : update->tempPath;
+
+		//A missing file hashes as all zeroes, which never matches
+		if (!CalculateFileHash(source, hash) || memcmp(hash, update->hash, 20))
+		{
+			Log (_T("Staged update is incomplete: %s is missing or changed"), source);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
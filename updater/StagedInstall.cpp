@@ -0,0 +1,280 @@
+#include "Updater.h"
+
+//Staged installs build a complete copy of the install next to it, with
+//unchanged files hard linked and updated files written fresh, then switch
+//directories with a rename. The live install is never half updated and a
+//failed update only has to throw the staged tree away.
+
+//Attributes belong to the file, not the link, so they can't be touched on a
+//file that is also part of the live install
+static BOOL IsHardLinked (const _TCHAR *path)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	BOOL ret = FALSE;
+
+	HANDLE hFile = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	if (GetFileInformationByHandle(hFile, &info))
+		ret = info.nNumberOfLinks > 1;
+
+	CloseHandle (hFile);
+
+	return ret;
+}
+
+//Left next to the install when the old tree couldn't be put back, so neither
+//a person nor the next update mistakes the retired tree for a leftover
+static VOID WriteRecoveryMarker (const _TCHAR *markerPath, const _TCHAR *installDir, const _TCHAR *retiredDir)
+{
+	_TCHAR text[MAX_PATH * 3];
+	char utf8[MAX_PATH * 9];
+	DWORD wrote;
+
+	StringCbPrintf(text, sizeof(text), _T("The OBS update couldn't restore the installation.\r\nRename\r\n\t%s\r\nback to\r\n\t%s\r\n"), retiredDir, installDir);
+
+	int length = WideCharToMultiByte(CP_UTF8, 0, text, -1, utf8, sizeof(utf8), NULL, NULL);
+	if (length <= 1)
+		return;
+
+	HANDLE hFile = CreateFile(markerPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	WriteFile (hFile, utf8, length - 1, &wrote, NULL);
+	CloseHandle (hFile);
+}
+
+BOOL DeleteDirectoryTree (const _TCHAR *path)
+{
+	_TCHAR search[MAX_PATH];
+	_TCHAR child[MAX_PATH];
+	WIN32_FIND_DATA findData;
+
+	StringCbPrintf(search, sizeof(search), _T("%s\\*"), path);
+
+	HANDLE hFind = FindFirstFile(search, &findData);
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			if (!_tcscmp(findData.cFileName, _T(".")) || !_tcscmp(findData.cFileName, _T("..")))
+				continue;
+
+			StringCbPrintf(child, sizeof(child), _T("%s\\%s"), path, findData.cFileName);
+
+			//Never follow a junction, only remove the link itself
+			if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			{
+				DeleteDirectoryTree (child);
+			}
+			else if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				RemoveDirectory (child);
+			}
+			else
+			{
+				if ((findData.dwFileAttributes & FILE_ATTRIBUTE_READONLY) && !IsHardLinked(child))
+					SetFileAttributes (child, FILE_ATTRIBUTE_NORMAL);
+
+				DeleteFile (child);
+			}
+		} while (FindNextFile(hFind, &findData));
+
+		FindClose (hFind);
+	}
+
+	return RemoveDirectory(path);
+}
+
+static BOOL LinkDirectoryTree (const _TCHAR *src, const _TCHAR *dest, int *linkedFiles)
+{
+	_TCHAR search[MAX_PATH];
+	_TCHAR srcChild[MAX_PATH];
+	_TCHAR destChild[MAX_PATH];
+	WIN32_FIND_DATA findData;
+	BOOL ret = TRUE;
+
+	if (!CreateDirectory(dest, NULL))
+		return FALSE;
+
+	StringCbPrintf(search, sizeof(search), _T("%s\\*"), src);
+
+	HANDLE hFind = FindFirstFile(search, &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+	do
+	{
+		if (!_tcscmp(findData.cFileName, _T(".")) || !_tcscmp(findData.cFileName, _T("..")))
+			continue;
+
+		//We can't faithfully reproduce junctions or symlinks, leave those installs to the in-place path
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+		{
+			Log (_T("Staged install: %s\\%s is a reparse point"), src, findData.cFileName);
+			ret = FALSE;
+			break;
+		}
+
+		StringCbPrintf(srcChild, sizeof(srcChild), _T("%s\\%s"), src, findData.cFileName);
+		StringCbPrintf(destChild, sizeof(destChild), _T("%s\\%s"), dest, findData.cFileName);
+
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			ret = LinkDirectoryTree(srcChild, destChild, linkedFiles);
+		}
+		else
+		{
+			ret = CreateHardLink(destChild, srcChild, NULL) || CopyFile(srcChild, destChild, TRUE);
+			if (ret)
+				(*linkedFiles)++;
+		}
+
+		if (!ret)
+		{
+			Log (_T("Staged install: couldn't stage %s (error %d)"), srcChild, GetLastError());
+			break;
+		}
+	} while (FindNextFile(hFind, &findData));
+
+	FindClose (hFind);
+
+	return ret;
+}
+
+//*fatal is set when the install directory is gone and nothing else may be tried
+BOOL InstallStaged (update_t *updates, BOOL *fatal)
+{
+	_TCHAR installDir[MAX_PATH];
+	_TCHAR parentDir[MAX_PATH];
+	_TCHAR stageDir[MAX_PATH];
+	_TCHAR retiredDir[MAX_PATH];
+	_TCHAR markerPath[MAX_PATH];
+	_TCHAR dest[MAX_PATH];
+	_TCHAR *p;
+	int linkedFiles = 0;
+
+	*fatal = FALSE;
+
+	if (!GetCurrentDirectory(_countof(installDir), installDir))
+		return FALSE;
+
+	StringCbCopy(parentDir, sizeof(parentDir), installDir);
+	p = _tcsrchr(parentDir, '\\');
+	if (!p || p == parentDir || p[-1] == ':')
+		return FALSE;
+	*p = 0;
+
+	StringCbPrintf(stageDir, sizeof(stageDir), _T("%s.staging"), installDir);
+	StringCbPrintf(retiredDir, sizeof(retiredDir), _T("%s.retired"), installDir);
+	StringCbPrintf(markerPath, sizeof(markerPath), _T("%s.RESTORE.txt"), installDir);
+
+	//An earlier run couldn't put the old tree back, it may be the only copy there is
+	if (GetFileAttributes(markerPath) != INVALID_FILE_ATTRIBUTES)
+	{
+		Log (_T("Staged install: %s exists, not touching %s"), markerPath, retiredDir);
+		return FALSE;
+	}
+
+	//Leftovers from an interrupted run
+	DeleteDirectoryTree (stageDir);
+	DeleteDirectoryTree (retiredDir);
+
+	Status (_T("Staging update..."));
+
+	if (!LinkDirectoryTree(installDir, stageDir, &linkedFiles))
+		goto failure;
+
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		BOOL ok;
+
+		StringCbPrintf(dest, sizeof(dest), _T("%s\\%s"), stageDir, update->outputPath);
+
+		//The staged copy is a hard link to the live file, writing through it would change the live install too
+		DeleteFile (dest);
+
+		if (update->patchable)
+		{
+			_TCHAR staleStaged[MAX_PATH];
+
+			StringCbPrintf(staleStaged, sizeof(staleStaged), _T("%s.new"), dest);
+			DeleteFile (staleStaged);
+
+			//Linked rather than moved so the in-place install can still use it if the swap fails
+			ok = CreateHardLink(dest, update->stagedPath, NULL) || CopyFile(update->stagedPath, dest, FALSE);
+		}
+		else
+		{
+			CreateFoldersForPath (dest);
+			ok = MyCopyFile(update->tempPath, dest);
+		}
+
+		if (!ok)
+		{
+			Log (_T("Staged install: couldn't stage %s (error %d)"), update->outputPath, GetLastError());
+			goto failure;
+		}
+	}
+
+	Status (_T("Switching to updated installation..."));
+
+	//There's no atomic directory exchange, so this is two renames with the old tree put back if the second fails
+	SetCurrentDirectory (parentDir);
+
+	if (!MoveFile(installDir, retiredDir))
+	{
+		Log (_T("Staged install: couldn't move %s aside (error %d)"), installDir, GetLastError());
+		goto failure;
+	}
+
+	if (!MoveFile(stageDir, installDir))
+	{
+		Log (_T("Staged install: couldn't move staged tree into place (error %d)"), GetLastError());
+
+		int i;
+		for (i = 0; !MoveFile(retiredDir, installDir) && i < 10; i++)
+			Sleep (100);
+
+		if (i == 10)
+		{
+			Log (_T("Staged install: couldn't move %s back to %s (error %d)"), retiredDir, installDir, GetLastError());
+
+			WriteRecoveryMarker (markerPath, installDir, retiredDir);
+
+			Status (_T("Update failed: OBS was left in %s. Rename it back to %s to restore it."), retiredDir, installDir);
+			*fatal = TRUE;
+
+			//The install lives on under the retired name, and the cleanup's relative paths with it
+			SetCurrentDirectory (retiredDir);
+
+			//The staged tree holds the new files, keep it in case it's all there is
+			return FALSE;
+		}
+
+		goto failure;
+	}
+
+	SetCurrentDirectory (installDir);
+
+	for (update_t *update = updates->next; update; update = update->next)
+		update->state = STATE_INSTALLED;
+
+	Log (_T("Staged install: linked %d files, switched directories"), linkedFiles);
+
+	DeleteDirectoryTree (retiredDir);
+
+	return TRUE;
+
+failure:
+	//The in-place install and the cleanup both work relative to the install
+	SetCurrentDirectory (installDir);
+
+	DeleteDirectoryTree (stageDir);
+
+	Log (_T("Staged install failed, installing in place instead"));
+
+	return FALSE;
+}
@@ -0,0 +1,77 @@
+#include "Updater.h"
+
+static DWORD HashUpdateKey (const char *packageName, const _TCHAR *basename)
+{
+	DWORD h = 2166136261u;
+
+	while (*packageName)
+	{
+		h ^= (BYTE)*packageName++;
+		h *= 16777619u;
+	}
+
+	h ^= '/';
+	h *= 16777619u;
+
+	while (*basename)
+	{
+		h ^= (DWORD)*basename++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+//(package, basename) -> update, so patch manifest entries don't have to scan the whole list
+BOOL BuildUpdateIndex (update_index_t *index, update_t *updates, int count)
+{
+	DWORD size = 16;
+	while (size < (DWORD)count * 2)
+		size *= 2;
+
+	index->buckets = (update_t **)calloc(size, sizeof(*index->buckets));
+	if (!index->buckets)
+		return FALSE;
+
+	index->mask = size - 1;
+
+	while (updates->next)
+	{
+		updates = updates->next;
+
+		//Keep the first entry for a key, the same one a list scan would have found
+		if (FindUpdate(index, updates->packageName, updates->basename))
+			continue;
+
+		DWORD bucket = HashUpdateKey(updates->packageName, updates->basename) & index->mask;
+
+		updates->indexNext = index->buckets[bucket];
+		index->buckets[bucket] = updates;
+	}
+
+	return TRUE;
+}
+
+update_t *FindUpdate (update_index_t *index, const char *packageName, const _TCHAR *basename)
+{
+	update_t *update = index->buckets[HashUpdateKey(packageName, basename) & index->mask];
+
+	while (update)
+	{
+		if (!strcmp(update->packageName, packageName) && !_tcscmp(update->basename, basename))
+			return update;
+
+		update = update->indexNext;
+	}
+
+	return NULL;
+}
+
+VOID FreeUpdateIndex (update_index_t *index)
+{
+	if (index->buckets)
+		free (index->buckets);
+
+	index->buckets = NULL;
+	index->mask = 0;
+}
@@ -18,22 +18,39 @@
 
 #include "Updater.h"
 
-CRITICAL_SECTION updateMutex;
-
 HANDLE cancelRequested;
 HANDLE updateThread;
 HINSTANCE hinstMain;
 HWND hwndMain;
 HCRYPTPROV hProvider;
 
+HANDLE hLogFile = INVALID_HANDLE_VALUE;
+CRITICAL_SECTION logMutex;
+
 BOOL bExiting;
 BOOL updateFailed = FALSE;
 
 BOOL downloadThreadFailure = FALSE;
 
-int totalFileSize = 0;
-int completedFileSize = 0;
-int completedUpdates = 0;
+volatile LONG totalFileSize = 0;
+volatile LONG completedFileSize = 0;
+volatile LONG completedUpdates = 0;
+
+BOOL bStagedInstall = FALSE;
+BOOL bPrefetch = FALSE;
+BOOL bStageOnly = FALSE;
+BOOL bApplyStaged = FALSE;
+BOOL bHeadless = FALSE;
+BOOL bAlwaysPatch = FALSE;
+BOOL bNothingStaged = FALSE;
+
+int downloadThreads = 0;
+int hashThreads = 0;
+
+_TCHAR cacheDirOption[MAX_PATH];
+ULONGLONG cacheLimit = DEFAULT_CACHE_LIMIT;
+
+volatile LONG hashedFiles = 0;
 
 //http://www.codeproject.com/Articles/320748/Haephrati-Elevating-during-runtime
 BOOL IsAppRunningAsAdminMode()
@@ -93,6 +110,33 @@ VOID Status (const _TCHAR *fmt, ...)
 	va_end(argptr);
 }
 
+VOID Log (const _TCHAR *fmt, ...)
+{
+	_TCHAR str[1024];
+	char utf8[2048];
+
+	if (hLogFile == INVALID_HANDLE_VALUE)
+		return;
+
+	va_list argptr;
+	va_start(argptr, fmt);
+
+	StringCbVPrintf(str, sizeof(str), fmt, argptr);
+	StringCbCat(str, sizeof(str), _T("\r\n"));
+
+	va_end(argptr);
+
+	int len = WideCharToMultiByte(CP_UTF8, 0, str, -1, utf8, sizeof(utf8), NULL, NULL);
+	if (len <= 1)
+		return;
+
+	DWORD wrote;
+
+	EnterCriticalSection (&logMutex);
+	WriteFile (hLogFile, utf8, len - 1, &wrote, NULL);
+	LeaveCriticalSection (&logMutex);
+}
+
 VOID CreateFoldersForPath (_TCHAR *path)
 {
 	_TCHAR *p = path;
@@ -114,7 +158,7 @@ BOOL MyCopyFile (_TCHAR *src, _TCHAR *dest)
 	int err = 0;
 	HANDLE hSrc = INVALID_HANDLE_VALUE, hDest = INVALID_HANDLE_VALUE;
 
-	hSrc = CreateFile (src, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	hSrc = CreateFile (src, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 	if (hSrc == INVALID_HANDLE_VALUE)
 	{
 		err = GetLastError();
@@ -179,26 +223,42 @@ VOID CleanupPartialUpdates (update_t *updates)
 	{
 		updates = updates->next;
 
-		if (updates->state == STATE_INSTALLED)
-		{
-			if (updates->previousFile)
-			{
-				DeleteFile (updates->outputPath);
-				MyCopyFile (updates->previousFile, updates->outputPath);
-				DeleteFile (updates->previousFile);
-			}
-			else
-			{
-				DeleteFile (updates->outputPath);
-			}
-		}
-		else if (updates->state == STATE_DOWNLOADED)
-		{
-			DeleteFile (updates->tempPath);
-		}
+		//Backups are renames, so putting the original back is just another rename
+		if (updates->previousFile)
+			MoveFileEx (updates->previousFile, updates->outputPath, MOVEFILE_REPLACE_EXISTING);
+		else if (updates->state == STATE_INSTALLED)
+			DeleteFile (updates->outputPath);
+
+		//Verified downloads stay in the cache for the next attempt
+		if (updates->state == STATE_STAGED)
+			DeleteFile (updates->stagedPath);
 	}
 }
 
+VOID FreeUpdate (update_t *update)
+{
+	if (update->outputPath)
+		free (update->outputPath);
+	if (update->previousFile)
+		free (update->previousFile);
+	if (update->tempPath)
+		free (update->tempPath);
+	if (update->downloadPath)
+		free (update->downloadPath);
+	if (update->stagedPath)
+		free (update->stagedPath);
+	if (update->sourceURL)
+		free (update->sourceURL);
+	if (update->fullSourceURL)
+		free (update->fullSourceURL);
+	if (update->basename)
+		free (update->basename);
+	if (update->packageName)
+		free (update->packageName);
+
+	free (update);
+}
+
 VOID DestroyUpdateList (update_t *updates)
 {
 	update_t *next;
@@ -207,29 +267,26 @@ VOID DestroyUpdateList (update_t *updates)
 	if (!updates)
 		return;
 
-	updates->next = NULL;
-
 	while (updates)
 	{
 		next = updates->next;
+		FreeUpdate (updates);
+		updates = next;
+	}
+}
 
-		if (updates->outputPath)
-			free (updates->outputPath);
-		if (updates->previousFile)
-			free (updates->previousFile);
-		if (updates->tempPath)
-			free (updates->tempPath);
-		if (updates->sourceURL)
-			free (updates->sourceURL);
-		if (updates->basename)
-			free (updates->basename);
-		if (updates->packageName)
-			free (updates->packageName);
+VOID CALLBACK HashInstalledFile (PTP_CALLBACK_INSTANCE instance, VOID *arg)
+{
+	update_t *update = (update_t *)arg;
 
-		free (updates);
+	//Left unhashed, the update thread stops once the pool drains
+	if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		return;
 
-		updates = next;
-	}
+	//We don't really care if this fails, it's just to avoid wasting bandwidth by downloading unmodified files
+	update->has_hash = CalculateFileHashCached(update->outputPath, update->my_hash);
+
+	InterlockedIncrement (&hashedFiles);
 }
 
 BOOL IsSafeFilename (_TCHAR *path)
@@ -279,157 +336,197 @@ BOOL IsSafePath (_TCHAR * path)
 	return TRUE;
 }
 
-DWORD WINAPI DownloadWorkerThread (VOID *arg)
+//A rename works even on a running EXE or a loaded DLL, so ask for exclusive
+//access first. That fails while anything still has the file open.
+static BOOL IsFileInUse (const _TCHAR *path)
 {
-	BOOL foundWork;
-	update_t *updates = (update_t *)arg;
-	
-	HINTERNET hSession = WinHttpOpen(_T("OBS Updater/2.1"), WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
-	if (!hSession)
-	{
-		downloadThreadFailure = TRUE;
-		Status(_T("Update failed: Couldn't open obsproject.com"));
-		return 1;
-	}
+	HANDLE hFile = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_SHARING_VIOLATION;
 
-	HINTERNET hConnect = WinHttpConnect(hSession, _T("obsproject.com"), INTERNET_DEFAULT_HTTPS_PORT, 0);
-	if (!hConnect)
+	CloseHandle (hFile);
+	return FALSE;
+}
+
+//Something like a virus scanner may still be looking at a backup we just
+//made, give it a moment before leaving the file for the next reboot
+static BOOL DeleteBackupFile (const _TCHAR *path)
+{
+	for (int i = 0; i < 5; i++)
 	{
-		downloadThreadFailure = TRUE;
-		Status (_T("Update failed: Couldn't connect to obsproject.com"));
-		return 1;
+		if (DeleteFile(path) || GetLastError() == ERROR_FILE_NOT_FOUND)
+			return TRUE;
+
+		Sleep (100);
 	}
 
-	for (;;)
+	if (MoveFileEx(path, NULL, MOVEFILE_DELAY_UNTIL_REBOOT))
+		Log (_T("Couldn't delete %s (error %d), it will be removed on the next reboot"), path, GetLastError());
+	else
+		Log (_T("Couldn't delete %s (error %d), it has been left behind"), path, GetLastError());
+
+	return FALSE;
+}
+
+//Replaces files in place one by one, backing each original up by rename so
+//CleanupPartialUpdates can put it back
+BOOL InstallUpdates (update_t *updates)
+{
+	_TCHAR oldFileRenamedPath[MAX_PATH];
+
+	ULONGLONG backupBytes = 0;
+	int backupFiles = 0;
+
+	while (updates->next)
 	{
-		foundWork = FALSE;
+		updates = updates->next;
 
-		EnterCriticalSection (&updateMutex);
+		if (updates->patchable)
+			Status (_T("Updating %s..."), updates->outputPath);
+		else
+			Status (_T("Installing %s..."), updates->outputPath);
 
-		while (updates->next)
+		//Check if we're replacing an existing file or just installing a new one
+		if (GetFileAttributes(updates->outputPath) != INVALID_FILE_ATTRIBUTES)
 		{
-			int responseCode;
+			_TCHAR *curFileName = NULL;
+			_TCHAR baseName[MAX_PATH];
 
-			if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+			StringCbCopy(baseName, sizeof(baseName), updates->outputPath);
+			curFileName = _tcsrchr(baseName, '/');
+			if (curFileName)
 			{
-				LeaveCriticalSection (&updateMutex);
-				return 1;
+				curFileName[0] = '\0';
+				curFileName++;
 			}
+			else
+				curFileName = baseName;
+			
+			//Backup the existing file in case a rollback is needed
+			StringCbCopy(oldFileRenamedPath, sizeof(oldFileRenamedPath), updates->outputPath);
+			StringCbCat(oldFileRenamedPath, sizeof(oldFileRenamedPath), _T(".old"));
 
-			updates = updates->next;
-
-			if (updates->state != STATE_PENDING_DOWNLOAD)
-				continue;
+			WIN32_FILE_ATTRIBUTE_DATA attributes;
+			if (GetFileAttributesEx(updates->outputPath, GetFileExInfoStandard, &attributes))
+				backupBytes += ((ULONGLONG)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
 
-			updates->state = STATE_DOWNLOADING;
+			if (IsFileInUse(updates->outputPath))
+			{
+				Status(_T("Update failed: %s is still in use. Close all programs and try again."), curFileName);
+				return FALSE;
+			}
 
-			LeaveCriticalSection (&updateMutex);
+			//A rename instead of a copy, the original never gets rewritten
+			if (!MoveFileEx(updates->outputPath, oldFileRenamedPath, MOVEFILE_REPLACE_EXISTING))
+			{
+				int is_sharing_violation = (GetLastError() == ERROR_SHARING_VIOLATION);
 
-			foundWork = TRUE;
+				if (is_sharing_violation)
+					Status(_T("Update failed: %s is still in use. Close all programs and try again."), curFileName);
+				else
+					Status(_T("Update failed: Couldn't backup %s (error %d)"), curFileName, GetLastError());
+				return FALSE;
+			}
 
-			if (downloadThreadFailure)
-				return 1;
+			updates->previousFile = _tcsdup(oldFileRenamedPath);
+			backupFiles++;
 
-			Status (_T("Downloading %s"), updates->outputPath);
+			int error_code;
+			BOOL installed_ok;
 
-			if (!HTTPGetFile (hSession, hConnect, updates->sourceURL, updates->tempPath, _T("Accept-Encoding: gzip"), &responseCode))
+			if (updates->patchable)
 			{
-				downloadThreadFailure = TRUE;
-				DeleteFile (updates->tempPath);
-				Status (_T("Update failed: Could not download %s (error code %d)"), updates->outputPath, responseCode);
-				return 1;
+				//Already patched and verified by the patch workers, just move it into place
+				installed_ok = MoveFileEx(updates->stagedPath, updates->outputPath, MOVEFILE_REPLACE_EXISTING);
+				error_code = GetLastError();
 			}
-
-			if (responseCode != 200)
+			else
 			{
-				downloadThreadFailure = TRUE;
-				DeleteFile (updates->tempPath);
-				Status (_T("Update failed: Could not download %s (error code %d)"), updates->outputPath, responseCode);
-				return 1;
+				installed_ok = MyCopyFile(updates->tempPath, updates->outputPath);
+				error_code = GetLastError();
 			}
 
-			BYTE downloadHash[20];
-			if (!CalculateFileHash(updates->tempPath, downloadHash))
+			if (!installed_ok)
 			{
-				downloadThreadFailure = TRUE;
-				DeleteFile (updates->tempPath);
-				Status (_T("Update failed: Couldn't verify integrity of %s"), updates->outputPath);
-				return 1;
+				int is_sharing_violation = (error_code == ERROR_SHARING_VIOLATION);
+
+				if (is_sharing_violation)
+					Status(_T("Update failed: %s is still in use. Close all programs and try again."), curFileName);
+				else
+					Status(_T("Update failed: Couldn't update %s (error %d)"), curFileName, GetLastError());
+				return FALSE;
 			}
 
-			if (memcmp(updates->downloadhash, downloadHash, 20))
+			updates->state = STATE_INSTALLED;
+		}
+		else
+		{
+			if (updates->patchable)
 			{
-				downloadThreadFailure = TRUE;
-				DeleteFile (updates->tempPath);
-				Status (_T("Update failed: Integrity check failed on %s"), updates->outputPath);
-				return 1;
+				//Uh oh, we thought we could patch something but it's no longer there!
+				Status(_T("Update failed: Source file %s not found"), updates->outputPath);
+				return FALSE;
 			}
 
-			EnterCriticalSection (&updateMutex);
+			//We may be installing into new folders, make sure they exist
+			CreateFoldersForPath (updates->outputPath);
 
-			updates->state = STATE_DOWNLOADED;
-			completedUpdates++;
-
-			LeaveCriticalSection (&updateMutex);
-		}
+			if (!MyCopyFile(updates->tempPath, updates->outputPath))
+			{
+				Status (_T("Update failed: Couldn't install %s (error %d)"), updates->outputPath, GetLastError());
+				return FALSE;
+			}
 
-		if (!foundWork)
-		{
-			LeaveCriticalSection (&updateMutex);
-			break;
+			updates->previousFile = NULL;
+			updates->state = STATE_INSTALLED;
 		}
-
-		if (downloadThreadFailure)
-			return 1;
 	}
 
-	if (hSession)
-		WinHttpCloseHandle(hSession);
+	Log (_T("Backed up %d files (%I64u bytes) by rename instead of copying"), backupFiles, backupBytes);
 
-	if (hConnect)
-		WinHttpCloseHandle(hConnect);
-
-	return 0;
+	return TRUE;
 }
 
-BOOL RunDownloadWorkers (int num, update_t *updates)
+//Swaps everything into the install and drops the backups once it all worked
+static BOOL CommitUpdates (update_t *updates)
 {
-	DWORD threadID;
-	HANDLE *handles;
-
-	InitializeCriticalSection (&updateMutex);
-
-	handles = (HANDLE *)malloc (sizeof(*handles) * num);
-	if (!handles)
-		return FALSE;
+	BOOL fatal = FALSE;
 
-	for (int i = 0; i < num; i++)
+	//Swap in a complete copy of the install if asked to, otherwise replace files in place
+	if (!bStagedInstall || !InstallStaged(updates, &fatal))
 	{
-		handles[i] = CreateThread (NULL, 0, DownloadWorkerThread, updates, 0, &threadID);
-		if (!handles[i])
+		//The install directory itself is missing, there's nothing to install into
+		if (fatal || !InstallUpdates (updates))
 			return FALSE;
 	}
 
-	WaitForMultipleObjects (num, handles, TRUE, INFINITE);
+	int leftBehind = 0;
 
-	for (int i = 0; i < num; i++)
+	//If we get here, all updates installed successfully so we can purge the old versions
+	while (updates->next)
 	{
-		DWORD exitCode;
-		GetExitCodeThread (handles[i], &exitCode);
-		if (exitCode != 0)
-			return FALSE;
+		updates = updates->next;
+
+		if (updates->previousFile && !DeleteBackupFile(updates->previousFile))
+			leftBehind++;
+
+		//Next run won't have to hash what we just verified
+		StoreFileHash (updates->outputPath, updates->hash);
+
+		//Downloads stay in the cache, marked as recently used
+		if (updates->tempPath)
+			TouchCachedDownload (updates);
 	}
 
+	if (leftBehind)
+		Log (_T("%d old files couldn't be deleted"), leftBehind);
+
 	return TRUE;
 }
 
-DWORD WINAPI UpdateThread (VOID *arg)
+//Returns FALSE if the update was cancelled before OBS went away
+static BOOL WaitForOBSExit ()
 {
-	DWORD ret = 1;
-
-	update_t updateList = {0};
-	update_t *updates = &updateList;
-
 	HANDLE hObsMutex;
 
 	hObsMutex = OpenMutex(SYNCHRONIZE, FALSE, TEXT("OBSMutex"));
@@ -447,15 +544,57 @@ DWORD WINAPI UpdateThread (VOID *arg)
 		CloseHandle(hObsMutex);
 
 		if (i == WAIT_OBJECT_0 + 1)
-			goto failure;
+			return FALSE;
 	}
 
+	return TRUE;
+}
+
+DWORD WINAPI UpdateThread (VOID *arg)
+{
+	DWORD ret = 1;
+
+	update_t updateList = {0};
+	update_t *updates = &updateList;
+
+	work_pool_t hashPool = {0};
+	update_index_t updateIndex = {0};
+	local_index_t localIndex = {0};
+	DWORD hashTime = 0;
+
+	//The cleanup after failure looks at these, so they have to be set before the first goto
+	TCHAR manifestPath[MAX_PATH];
+	TCHAR tempPath[MAX_PATH];
+	TCHAR cachePath[MAX_PATH];
+	TCHAR logPath[MAX_PATH];
+	TCHAR hashCachePath[MAX_PATH];
+	TCHAR planPath[MAX_PATH];
+	TCHAR throughputPath[MAX_PATH];
+	TCHAR lpAppDataPath[MAX_PATH];
+	BYTE manifestHash[20];
+
+	manifestPath[0] = 0;
+	tempPath[0] = 0;
+	cachePath[0] = 0;
+	logPath[0] = 0;
+	hashCachePath[0] = 0;
+	planPath[0] = 0;
+	throughputPath[0] = 0;
+	lpAppDataPath[0] = 0;
+
 	if (!CryptAcquireContext(&hProvider, NULL, MS_ENH_RSA_AES_PROV, PROV_RSA_AES, CRYPT_VERIFYCONTEXT))
 	{
 		SetDlgItemText(hwndMain, IDC_STATUS, TEXT("Update failed: CryptAcquireContext failure"));
 		goto failure;
 	}
 
+	//Shared by the manifest request and every download, so connections and TLS sessions get reused
+	if (!HTTPInitPool(MAX_CONNS_PER_HOST))
+	{
+		Status (_T("Update failed: Couldn't open a network session"));
+		goto failure;
+	}
+
 	SetDlgItemText(hwndMain, IDC_STATUS, TEXT("Searching for available updates..."));
 
 	BOOL bIsPortable = FALSE;
@@ -473,23 +612,50 @@ DWORD WINAPI UpdateThread (VOID *arg)
 		*p = '\0';
 		p++;
 
-		if (!_tcscmp(p, _T("Portable")))
-			bIsPortable = TRUE;
+		_TCHAR *context = NULL;
+		_TCHAR *option = _tcstok_s(p, _T(" "), &context);
+
+		while (option)
+		{
+			if (!_tcscmp(option, _T("Portable")))
+				bIsPortable = TRUE;
+			else if (!_tcscmp(option, _T("Staged")))
+				bStagedInstall = TRUE;
+			else if (!_tcscmp(option, _T("Prefetch")))
+				bPrefetch = TRUE;
+			else if (!_tcscmp(option, _T("Stage")))
+				bStageOnly = TRUE;
+			else if (!_tcscmp(option, _T("Apply")))
+				bApplyStaged = TRUE;
+			else if (!_tcscmp(option, _T("AlwaysPatch")))
+				bAlwaysPatch = TRUE;
+			else if (!_tcsncmp(option, _T("DownloadThreads="), 16))
+				downloadThreads = _ttoi(option + 16);
+			else if (!_tcsncmp(option, _T("HashThreads="), 12))
+				hashThreads = _ttoi(option + 12);
+			else if (!_tcsncmp(option, _T("PatchMemoryMB="), 14) && _ttoi(option + 14) > 0)
+				patchMemoryLimit = min(_ttoi(option + 14), 1024) * 1024 * 1024;
+			else if (!_tcsncmp(option, _T("CacheDir="), 9))
+				StringCbCopy(cacheDirOption, sizeof(cacheDirOption), option + 9);
+			else if (!_tcsncmp(option, _T("CacheLimitMB="), 13) && _ttoi(option + 13) >= 0)
+				cacheLimit = (ULONGLONG)_ttoi(option + 13) * 1024 * 1024;
+
+			option = _tcstok_s(NULL, _T(" "), &context);
+		}
 	}
 
 	const _TCHAR *targetPlatform = cmdLine;
 
-	TCHAR manifestPath[MAX_PATH];
-	TCHAR tempPath[MAX_PATH];
-	TCHAR lpAppDataPath[MAX_PATH];
-
-	manifestPath[0] = 0;
-	tempPath[0] = 0;
-	lpAppDataPath[0] = 0;
+	//Prefetch never replaces installed files, so everything up to verified downloads and patches can happen while OBS is still open
+	if (!bPrefetch && !bStageOnly && !bApplyStaged && !WaitForOBSExit())
+		goto failure;
 
 	if (bIsPortable)
 	{
 		GetCurrentDirectory(_countof(lpAppDataPath), lpAppDataPath);
+
+		//Our own log and caches live inside the install, so it can't be renamed out from under them
+		bStagedInstall = FALSE;
 	}
 	else
 	{
@@ -507,8 +673,51 @@ DWORD WINAPI UpdateThread (VOID *arg)
 
 	StringCbPrintf(manifestPath, sizeof(manifestPath), TEXT("%s\\updates\\packages.xconfig"), lpAppDataPath);
 	StringCbPrintf(tempPath, sizeof(tempPath), TEXT("%s\\updates\\temp"), lpAppDataPath);
+	StringCbPrintf(logPath, sizeof(logPath), TEXT("%s\\updates\\updater.log"), lpAppDataPath);
+	StringCbPrintf(hashCachePath, sizeof(hashCachePath), TEXT("%s\\updates\\hashcache.dat"), lpAppDataPath);
+	StringCbPrintf(planPath, sizeof(planPath), TEXT("%s\\updates\\staged.plan"), lpAppDataPath);
+	StringCbPrintf(throughputPath, sizeof(throughputPath), TEXT("%s\\updates\\throughput.dat"), lpAppDataPath);
+
+	hLogFile = CreateFile(logPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+
+	LoadHashCache(hashCachePath);
+	LoadThroughputStats(throughputPath);
+
+	//Non-portable installs share one cache per user, CacheDir= lets any installs on a machine share one
+	if (cacheDirOption[0])
+	{
+		StringCbCopy(cachePath, sizeof(cachePath), cacheDirOption);
+	}
+	else
+	{
+		PWSTR pOut;
+		if (!bIsPortable && SHGetKnownFolderPath(FOLDERID_LocalAppData, KF_FLAG_DEFAULT, NULL, &pOut) == S_OK)
+		{
+			StringCbPrintf(cachePath, sizeof(cachePath), TEXT("%s\\OBS\\updates\\cache"), pOut);
+			CoTaskMemFree (pOut);
+		}
+		else
+		{
+			StringCbPrintf(cachePath, sizeof(cachePath), TEXT("%s\\updates\\cache"), lpAppDataPath);
+		}
+	}
+
+	if (!InitDownloadCache(cachePath))
+	{
+		Status (_T("Update failed: Couldn't create download cache %s"), cachePath);
+		goto failure;
+	}
+
+	//A staged plan is only good for the manifest it was made from
+	if ((bStageOnly || bApplyStaged) && !CalculateFileHash(manifestPath, manifestHash))
+	{
+		Status (TEXT("Update failed: Could not open update manifest"));
+		goto failure;
+	}
 
-	CreateDirectory(tempPath, NULL);
+	//A failed Stage run must not leave an older plan behind
+	if (bStageOnly)
+		DeleteFile (planPath);
 
 	HANDLE hManifest = CreateFile(manifestPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
 	if (hManifest == INVALID_HANDLE_VALUE)
@@ -578,6 +787,12 @@ DWORD WINAPI UpdateThread (VOID *arg)
 
 	int totalUpdates = 0;
 
+	if (hashThreads <= 0)
+		hashThreads = GetCoreCount();
+
+	CreateWorkPool (&hashPool, hashThreads);
+	hashTime = GetTickCount();
+
 	json_object_foreach (root, packageName, package)
 	{
 		if (!json_is_object(package))
@@ -646,11 +861,14 @@ DWORD WINAPI UpdateThread (VOID *arg)
 
 			int fileSize = (int)json_integer_value(size);
 
+			//Only files the server says it has a .blocks or .chunks list for are worth asking about
+			json_t *blocks = json_object_get(file, "blocks");
+			json_t *chunks = json_object_get(file, "chunks");
+
 			_TCHAR sourceURL[1024];
 			_TCHAR fullPath[MAX_PATH];
 			_TCHAR updateFileName[MAX_PATH];
 			_TCHAR updateHashStr[41];
-			_TCHAR tempFilePath[MAX_PATH];
 
 			if (!MultiByteToWideChar(CP_UTF8, 0, pathStr, -1, fullPath, _countof(fullPath)))
 				continue;
@@ -679,54 +897,120 @@ DWORD WINAPI UpdateThread (VOID *arg)
 				continue;
 			StringCbCat(sourceURL, sizeof(sourceURL), updateFileName);
 
-			StringCbPrintf(tempFilePath, sizeof(tempFilePath), _T("%s\\%s"), tempPath, updateHashStr);
-
-			BYTE existingHash[20];
-			_TCHAR fileHashStr[41];
-			int has_hash;
-
-			//We don't really care if this fails, it's just to avoid wasting bandwidth by downloading unmodified files
-			if (CalculateFileHash(fullPath, existingHash))
-			{
-				HashToString(existingHash, fileHashStr);
-
-				if (!_tcscmp(fileHashStr, updateHashStr))
-					continue;
-
-				has_hash = 1;
-			}
-			else
-			{
-				has_hash = 0;
-			}
-
 			updates->next = (update_t *)malloc(sizeof(*updates));
 			updates = updates->next;
 
 			updates->next = NULL;
+			updates->duplicates = NULL;
+			updates->nextDuplicate = NULL;
 			updates->fileSize = fileSize;
 			updates->previousFile = NULL;
+			updates->stagedPath = NULL;
+			updates->errorCode = 0;
+			updates->attempts = 0;
+			updates->fullSourceURL = NULL;
+			updates->fullFileSize = 0;
+			updates->skippedBytes = 0;
 			updates->basename = _tcsdup(updateFileName);
 			updates->outputPath = _tcsdup(fullPath);
-			updates->tempPath = _tcsdup(tempFilePath);
+			updates->tempPath = NULL;
+			updates->downloadPath = NULL;
 			updates->sourceURL = _tcsdup(sourceURL);
 			updates->packageName = _strdup(packageName);
 			updates->state = STATE_PENDING_DOWNLOAD;
 			updates->patchable = 0;
+			updates->has_blocks = json_is_true(blocks);
+			updates->has_chunks = json_is_true(chunks);
+			updates->has_hash = 0;
 			StringToHash(updateHashStr, updates->downloadhash);
 			memcpy(updates->hash, updates->downloadhash, sizeof(updates->hash));
-			
-			updates->has_hash = has_hash;
-			if (has_hash)
-				StringToHash(fileHashStr, updates->my_hash);
+			SetCachePath (updates);
 
-			totalUpdates++;
-			totalFileSize += fileSize;
+			//Hash the installed copy in the background while we keep walking the manifest
+			QueueWork (&hashPool, HashInstalledFile, updates);
 		}
 	}
 
 	json_decref(root);
 
+	FinishWorkPool (&hashPool);
+
+	if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
+		goto failure;
+
+	hashTime = GetTickCount() - hashTime;
+	Log (_T("Hashed %d installed files (%I64d bytes) in %u ms on %d threads"), hashedFiles, hashedBytes, hashTime, hashThreads);
+
+	//Drop everything that is already up to date
+	updates = &updateList;
+	while (updates->next)
+	{
+		update_t *update = updates->next;
+
+		if (update->has_hash)
+			AddLocalFile (&localIndex, update->my_hash, update->outputPath);
+
+		if (update->has_hash && !memcmp(update->my_hash, update->hash, sizeof(update->hash)))
+		{
+			updates->next = update->next;
+			FreeUpdate (update);
+			continue;
+		}
+
+		totalUpdates++;
+		totalFileSize += update->fileSize;
+
+		updates = update;
+	}
+
+	//Everything was downloaded, patched and verified by an earlier Stage run, only the swap is left.
+	//The plan only says what was staged, what the files have to be still comes from the manifest.
+	if (bApplyStaged)
+	{
+		int stagedUpdates;
+
+		if (!LoadStagePlan(planPath, manifestHash, &updateList, &stagedUpdates))
+		{
+			DeleteFile (planPath);
+			Status (_T("Update failed: No usable staged update"));
+			goto failure;
+		}
+
+		//The Stage run found everything up to date
+		if (!stagedUpdates)
+		{
+			DeleteFile (planPath);
+			Status (_T("All available updates are already installed."));
+			goto finished;
+		}
+
+		if (!WaitForOBSExit())
+			goto failure;
+
+		DWORD applyTime = GetTickCount();
+
+		if (!VerifyStagePlan(&updateList))
+		{
+			DeleteFile (planPath);
+			Status (_T("Update failed: Staged update is out of date"));
+			goto failure;
+		}
+
+		//Whatever happens now, the staged files are used up
+		DeleteFile (planPath);
+
+		if (!CommitUpdates(&updateList))
+			goto failure;
+
+		Log (_T("Applied %d staged updates in %u ms"), stagedUpdates, GetTickCount() - applyTime);
+
+		Status (_T("Update complete."));
+		goto finished;
+	}
+
+	//Content we want that already exists somewhere else in the install is copied, not downloaded
+	ReuseLocalFiles (&localIndex, &updateList);
+
 	if (totalUpdates)
 	{
 		json_t *req, *files, *packageFiles;
@@ -757,7 +1041,8 @@ DWORD WINAPI UpdateThread (VOID *arg)
 				lastPackage = updates->packageName;
 			}
 
-			if (!updates->has_hash)
+			//No point asking for a patch for something we already have
+			if (!updates->has_hash || updates->state != STATE_PENDING_DOWNLOAD)
 				continue;
 
 			HashToString(updates->my_hash, hash_string);
@@ -815,6 +1100,12 @@ DWORD WINAPI UpdateThread (VOID *arg)
 		const char *patchpackageName;
 		json_t *patchpackage;
 
+		if (!BuildUpdateIndex(&updateIndex, &updateList, totalUpdates))
+		{
+			Status(_T("Update failed: Could not allocate memory for update index"));
+			goto failure;
+		}
+
 		json_object_foreach(root, patchpackageName, patchpackage)
 		{
 			if (!json_is_object(patchpackage))
@@ -827,7 +1118,6 @@ DWORD WINAPI UpdateThread (VOID *arg)
 			const char *patchableFilename;
 
 			_TCHAR widePatchableFilename[MAX_PATH];
-			_TCHAR widePatchHash[MAX_PATH];
 			_TCHAR patchHashStr[41];
 
 			json_object_foreach(patchpackage, patchableFilename, value)
@@ -858,201 +1148,151 @@ DWORD WINAPI UpdateThread (VOID *arg)
 
 				int patchSize = (int)json_integer_value(size);
 
-				MultiByteToWideChar(CP_UTF8, 0, patchableFilename, -1, widePatchableFilename, sizeof(widePatchableFilename));
-				MultiByteToWideChar(CP_UTF8, 0, patchHash, -1, widePatchHash, sizeof(widePatchHash));
+				if (!MultiByteToWideChar(CP_UTF8, 0, patchableFilename, -1, widePatchableFilename, _countof(widePatchableFilename)))
+					continue;
 
-				updates = &updateList;
-				while (updates->next)
-				{
-					updates = updates->next;
-					if (strcmp(updates->packageName, patchpackageName))
-						continue;
-					if (_tcscmp(updates->basename, widePatchableFilename))
-						continue;
+				updates = FindUpdate(&updateIndex, patchpackageName, widePatchableFilename);
+				if (!updates || updates->state != STATE_PENDING_DOWNLOAD || updates->patchable)
+					continue;
 
-					// Replace the source URL with the patch file and mark it as patchable
-					updates->patchable = true;
+				//On a fast connection a large file can arrive whole sooner than bspatch could rebuild it
+				if (!bAlwaysPatch && !PatchIsCheaper(updates, patchSize))
+					continue;
 
-					free(updates->sourceURL);
+				_TCHAR sourceURL[1024];
+				if (!MultiByteToWideChar(CP_UTF8, 0, sourceStr, -1, sourceURL, _countof(sourceURL)))
+					continue;
 
-					_TCHAR sourceURL[1024];
-					if (!MultiByteToWideChar(CP_UTF8, 0, sourceStr, -1, sourceURL, _countof(sourceURL)))
-						continue;
+				if (!MultiByteToWideChar(CP_UTF8, 0, patchHash, -1, patchHashStr, _countof(patchHashStr)))
+					continue;
 
-					if (!MultiByteToWideChar(CP_UTF8, 0, patchHash, -1, patchHashStr, _countof(patchHashStr)))
-						continue;
+				// Replace the source URL with the patch file and mark it as patchable
+				updates->patchable = true;
 
-					StringToHash(patchHashStr, updates->downloadhash);
+				StringToHash(patchHashStr, updates->downloadhash);
 
-					// Re-calculate download size
-					totalFileSize -= (updates->fileSize - patchSize);
-					updates->sourceURL = _tcsdup(sourceURL);
-					updates->fileSize = patchSize;
+				// Re-calculate download size
+				totalFileSize -= (updates->fileSize - patchSize);
 
-					break;
-				}
+				//Kept in case the patch can't be downloaded or applied
+				updates->fullSourceURL = updates->sourceURL;
+				updates->fullFileSize = updates->fileSize;
 
+				updates->sourceURL = _tcsdup(sourceURL);
+				updates->fileSize = patchSize;
 			}
 		}
 
+		FreeUpdateIndex (&updateIndex);
+
 		//-------------------
 		//Download Updates
 		//-------------------
-		updates = &updateList;
-		if (!RunDownloadWorkers (2, updates))
-			goto failure;
-
-		//----------------
-		//Install updates
-		//----------------
-		if (completedUpdates == totalUpdates)
-		{
-			_TCHAR oldFileRenamedPath[MAX_PATH];
+		ReuseCachedDownloads (&updateList);
 
-			updates = &updateList;
-			while (updates->next)
-			{
-				updates = updates->next;
-
-				if (updates->patchable)
-					Status (_T("Updating %s..."), updates->outputPath);
-				else
-					Status (_T("Installing %s..."), updates->outputPath);
-
-				//Check if we're replacing an existing file or just installing a new one
-				if (GetFileAttributes(updates->outputPath) != INVALID_FILE_ATTRIBUTES)
-				{
-					_TCHAR *curFileName = NULL;
-					_TCHAR baseName[MAX_PATH];
+		//Files without a patch may still be mostly the same as what we have
+		RunDeltaSync (&updateList);
 
-					StringCbCopy(baseName, sizeof(baseName), updates->outputPath);
-					curFileName = _tcsrchr(baseName, '/');
-					if (curFileName)
-					{
-						curFileName[0] = '\0';
-						curFileName++;
-					}
-					else
-						curFileName = baseName;
-					
-					//Backup the existing file in case a rollback is needed
-					StringCbCopy(oldFileRenamedPath, sizeof(oldFileRenamedPath), updates->outputPath);
-					StringCbCat(oldFileRenamedPath, sizeof(oldFileRenamedPath), _T(".old"));
+		//Anything left can still share chunks with unrelated local files
+		RunChunkSync (&localIndex, &updateList);
+		FreeLocalIndex (&localIndex);
 
-					if (!MyCopyFile(updates->outputPath, oldFileRenamedPath))
-					{
-						int is_sharing_violation = (GetLastError() == ERROR_SHARING_VIOLATION);
+		//One request for all the small files instead of a round trip each
+		RunBatchDownload (&updateList);
 
-						if (is_sharing_violation)
-							Status(_T("Update failed: %s is still in use. Close all programs and try again."), curFileName);
-						else
-							Status(_T("Update failed: Couldn't backup %s (error %d)"), curFileName, GetLastError());
-						goto failure;
-					}
+		//Patching starts as soon as each patch is downloaded, behind the downloads still running
+		StartPatchWorkers ();
 
-					int error_code;
-					BOOL installed_ok;
+		if (!QueueDownloadedPatches (&updateList))
+			goto failure;
 
-					if (updates->patchable)
-					{
-						error_code = ApplyPatch(updates->tempPath, updates->outputPath);
-						installed_ok = (error_code == 0);
-
-						if (installed_ok)
-						{
-							BYTE patchedFileHash[20];
-							if (!CalculateFileHash(updates->outputPath, patchedFileHash))
-							{
-								Status(_T("Update failed: Couldn't verify integrity of patched %s"), curFileName);
-								goto failure;
-							}
-
-							if (memcmp(updates->hash, patchedFileHash, 20))
-							{
-								Status(_T("Update failed: Integrity check of patched %s failed"), curFileName);
-								goto failure;
-							}
-						}
-					}
-					else
-					{
-						installed_ok = MyCopyFile(updates->tempPath, updates->outputPath);
-						error_code = GetLastError();
-					}
+		updates = &updateList;
+		if (!RunDownloadWorkers (downloadThreads, updates))
+			goto failure;
 
-					if (!installed_ok)
-					{
-						int is_sharing_violation = (error_code == ERROR_SHARING_VIOLATION);
+		if (!FinishPatchWorkers (&updateList))
+			goto failure;
 
-						if (is_sharing_violation)
-							Status(_T("Update failed: %s is still in use. Close all programs and try again."), curFileName);
-						else
-							Status(_T("Update failed: Couldn't update %s (error %d)"), curFileName, GetLastError());
-						goto failure;
-					}
+		//Patches that didn't apply are fetched whole
+		if (!RunDownloadWorkers (downloadThreads, updates))
+			goto failure;
 
-					updates->previousFile = _tcsdup(oldFileRenamedPath);
-					updates->state = STATE_INSTALLED;
-				}
-				else
-				{
-					if (updates->patchable)
-					{
-						//Uh oh, we thought we could patch something but it's no longer there!
-						Status(_T("Update failed: Source file %s not found"), updates->outputPath);
-						goto failure;
-					}
+		//----------------
+		//Install updates
+		//----------------
+		if (completedUpdates == totalUpdates)
+		{
+			if (bPrefetch)
+			{
+				DWORD waitTime = GetTickCount();
 
-					//We may be installing into new folders, make sure they exist
-					CreateFoldersForPath (updates->outputPath);
+				Status (_T("Update downloaded, waiting for OBS to close..."));
 
-					if (!MyCopyFile(updates->tempPath, updates->outputPath))
-					{
-						Status (_T("Update failed: Couldn't install %s (error %d)"), updates->outputPath, GetLastError());
-						goto failure;
-					}
+				if (!WaitForOBSExit())
+					goto failure;
 
-					updates->previousFile = NULL;
-					updates->state = STATE_INSTALLED;
-				}
+				Log (_T("Prefetched %d updates, waited %u ms for OBS to close"), totalUpdates, GetTickCount() - waitTime);
 			}
 
-			//If we get here, all updates installed successfully so we can purge the old versions
-			updates = &updateList;
-			while (updates->next)
+			if (bStageOnly)
 			{
-				updates = updates->next;
-
-				if (updates->previousFile)
-					DeleteFile (updates->previousFile);
+				if (!SaveStagePlan (planPath, manifestHash, &updateList))
+				{
+					Status (_T("Update failed: Couldn't save staged update (error %d)"), GetLastError());
+					goto failure;
+				}
 
-				//We delete here not above in case of duplicate hashes
-				if (updates->tempPath)
-					DeleteFile(updates->tempPath);
+				Status (_T("Update staged."));
+				goto finished;
 			}
+
+			if (!CommitUpdates (&updateList))
+				goto failure;
+		}
+		else if (bStageOnly)
+		{
+			//Apply would only find no plan and fail
+			Status (_T("Update failed: Not all updates could be staged"));
+			goto failure;
 		}
 
 		Status(_T("Update complete."));
 	}
 	else
 	{
+		//An empty plan still tells Apply this manifest was looked at and nothing needs doing
+		if (bStageOnly)
+		{
+			if (!SaveStagePlan (planPath, manifestHash, &updateList))
+			{
+				Status (_T("Update failed: Couldn't save staged update (error %d)"), GetLastError());
+				goto failure;
+			}
+
+			bNothingStaged = TRUE;
+		}
+
 		Status (_T("All available updates are already installed."));
 	}
 
+finished:
 	ret = 0;
 
 	SetDlgItemText(hwndMain, IDC_BUTTON, _T("Launch OBS"));
 
 failure:
 
+	//Hash and patch jobs still point into the update list
+	FinishWorkPool (&hashPool);
+	StopPatchWorkers ();
+	FreeUpdateIndex (&updateIndex);
+	FreeLocalIndex (&localIndex);
+
 	if (ret)
 	{
 		//This handles deleting temp files and rolling back and partially installed updates
 		CleanupPartialUpdates (&updateList);
 		
-		if (tempPath[0])
-			RemoveDirectory (tempPath);
-
 		if (WaitForSingleObject(cancelRequested, 0) == WAIT_OBJECT_0)
 			Status (_T("Update aborted."));
 
@@ -1065,12 +1305,41 @@ failure:
 	}
 	else
 	{
+		//Left over from before downloads went into the cache
 		if (tempPath[0])
-			RemoveDirectory (tempPath);
+			DeleteDirectoryTree (tempPath);
+
+		//A staged update needs its downloads until it's applied
+		if (cachePath[0] && !bStageOnly)
+			TrimDownloadCache (cacheLimit);
+
+		if (planPath[0] && !bStageOnly)
+			DeleteFile (planPath);
 	}
 
 	DestroyUpdateList (&updateList);
 
+	HTTPFreePool ();
+
+	if (hashCachePath[0])
+	{
+		SaveHashCache (hashCachePath);
+		FreeHashCache ();
+	}
+
+	if (throughputPath[0])
+		SaveThroughputStats (throughputPath);
+
+	if (hLogFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle (hLogFile);
+		hLogFile = INVALID_HANDLE_VALUE;
+	}
+
+	//Only the process exit code tells the two apart, the cleanup above treats both as success
+	if (!ret && bNothingStaged)
+		ret = EXIT_NOTHING_STAGED;
+
 	if (bExiting)
 		ExitProcess (ret);
 
@@ -1154,14 +1423,35 @@ INT_PTR CALLBACK DialogProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lPara
 	return FALSE;
 }
 
+//Only for what has to be known before the update thread parses the command line
+static BOOL HasOption (const _TCHAR *cmdLine, const _TCHAR *option)
+{
+	_TCHAR buffer[1024];
+	_TCHAR *context = NULL;
+
+	StringCbCopy(buffer, sizeof(buffer), cmdLine);
+
+	for (_TCHAR *token = _tcstok_s(buffer, _T(" "), &context); token; token = _tcstok_s(NULL, _T(" "), &context))
+	{
+		if (!_tcscmp(token, option))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
 int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLine, int nShowCmd)
 {
 	INITCOMMONCONTROLSEX icce;
 
+	//Stage and Apply runs are started by OBS itself and never show a window
+	bHeadless = HasOption(lpCmdLine, _T("Stage")) || HasOption(lpCmdLine, _T("Apply"));
+
 	if (!IsAppRunningAsAdminMode())
 	{
 		HANDLE hLowMutex = CreateMutex (NULL, TRUE, _T("OBSUpdaterRunningAsNonAdminUser"));
 		_TCHAR myPath[MAX_PATH];
+		int exitRet = 0;
 		if (GetModuleFileName (NULL, myPath, _countof(myPath)-1))
 		{
 			_TCHAR cwd[MAX_PATH];
@@ -1175,7 +1465,7 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdL
 			shExInfo.lpFile = myPath;	 // Application to start	
 			shExInfo.lpParameters = lpCmdLine;				// Additional parameters
 			shExInfo.lpDirectory = cwd;
-			shExInfo.nShow = SW_NORMAL;
+			shExInfo.nShow = bHeadless ? SW_HIDE : SW_NORMAL;
 			shExInfo.hInstApp = 0;
 
 			//annoyingly the actual elevated updater will disappear behind other windows :(
@@ -1185,9 +1475,15 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdL
 			{
 				DWORD exitCode;
 
+				//Whoever started a headless run wants to know how it went
+				if (bHeadless)
+					WaitForSingleObject (shExInfo.hProcess, INFINITE);
+
 				if (GetExitCodeProcess (shExInfo.hProcess, &exitCode))
 				{
-					if (exitCode == 1)
+					if (bHeadless)
+						exitRet = (int)exitCode;
+					else if (exitCode == 1)
 						LaunchOBS ();
 				}
 				CloseHandle (shExInfo.hProcess);
@@ -1200,7 +1496,7 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdL
 			CloseHandle (hLowMutex);
 		}
 
-		return 0;
+		return exitRet;
 	}
 	else
 	{
@@ -1216,11 +1512,23 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdL
 		if (!hwndMain)
 			return -1;
 
-		ShowWindow (hwndMain, SW_SHOWNORMAL);
-		SetForegroundWindow (hwndMain);
-
 		cancelRequested = CreateEvent (NULL, TRUE, FALSE, NULL);
 
+		//Status still goes to the hidden dialog, the update thread quits the process when it's done
+		if (bHeadless)
+		{
+			bExiting = TRUE;
+		}
+		else
+		{
+			ShowWindow (hwndMain, SW_SHOWNORMAL);
+			SetForegroundWindow (hwndMain);
+		}
+
+		InitializeCriticalSection (&logMutex);
+		InitHashCache ();
+		InitThroughputStats ();
+
 		updateThread = CreateThread (NULL, 0, UpdateThread, lpCmdLine, 0, NULL);
 
 		MSG msg;
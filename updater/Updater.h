@@ -36,16 +36,23 @@ typedef enum
 	STATE_INVALID,
 	STATE_PENDING_DOWNLOAD,
 	STATE_DOWNLOADING,
+	STATE_WAITING,
 	STATE_DOWNLOADED,
+	STATE_STAGED,
 	STATE_INSTALLED,
 } state_t;
 
 typedef struct update_s
 {
 	struct update_s *next;
+	struct update_s *indexNext;
+	struct update_s *duplicates;
+	struct update_s *nextDuplicate;
 	_TCHAR		*sourceURL;
 	_TCHAR		*outputPath;
 	_TCHAR		*tempPath;
+	_TCHAR		*downloadPath;
+	_TCHAR		*stagedPath;
 	_TCHAR		*previousFile;
 	_TCHAR		*basename;
 	DWORD		fileSize;
@@ -53,26 +60,206 @@ typedef struct update_s
 	state_t		state;
 	int			has_hash;
 	int			patchable;
+	int			has_blocks;
+	int			has_chunks;
 	BYTE		downloadhash[20];
 	BYTE		my_hash[20];
 	char		*packageName;
+	int			errorCode;
+	int			attempts;
+	_TCHAR		*fullSourceURL;
+	DWORD		fullFileSize;
+	DWORD		skippedBytes;
 } update_t;
 
-BOOL HTTPGetFile (HINTERNET hSession, HINTERNET hConnect, const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, int *responseCode);
+typedef struct
+{
+	update_t	**buckets;
+	DWORD		mask;
+} update_index_t;
+
+BOOL BuildUpdateIndex (update_index_t *index, update_t *updates, int count);
+update_t *FindUpdate (update_index_t *index, const char *packageName, const _TCHAR *basename);
+VOID FreeUpdateIndex (update_index_t *index);
+
+//SHA-1 of a byte stream, fed incrementally as the data passes through
+typedef struct
+{
+	HCRYPTHASH	hHash;
+	ULONGLONG	length;
+} hash_sink_t;
+
+BOOL HTTPInitPool (DWORD maxConnsPerHost);
+VOID HTTPFreePool ();
+BOOL HTTPGetFile (const _TCHAR *url, const _TCHAR *outputPath, const _TCHAR *extraHeaders, ULONGLONG resumeOffset, int *responseCode, hash_sink_t *sink);
+BOOL HTTPGetRange (const _TCHAR *url, HANDLE hFile, ULONGLONG offset, ULONGLONG length, int *responseCode);
 BOOL HTTPPostData(const _TCHAR *url, const BYTE *data, int dataLen, const _TCHAR *extraHeaders, int *responseCode, BYTE **response, int *responseLen);
+BOOL HTTPGetData(const _TCHAR *url, const _TCHAR *extraHeaders, int *responseCode, BYTE **response, int *responseLen);
+
+typedef BOOL (*http_stream_callback_t)(const BYTE *data, DWORD len, VOID *param);
+
+BOOL HTTPPostStream (const _TCHAR *url, const BYTE *data, int dataLen, int *responseCode, http_stream_callback_t callback, VOID *param);
 
 VOID HashToString (BYTE *in, TCHAR *out);
 VOID StringToHash (TCHAR *in, BYTE *out);
 
+BOOL HashSinkInit (hash_sink_t *sink);
+BOOL HashSinkWrite (hash_sink_t *sink, const BYTE *data, DWORD len);
+BOOL HashSinkFinish (hash_sink_t *sink, BYTE *hash);
+VOID HashSinkFree (hash_sink_t *sink);
+
+BOOL CalculateHandleHash (HANDLE hFile, BYTE *hash);
 BOOL CalculateFileHash (TCHAR *path, BYTE *hash);
 
-BOOL ApplyPatch(LPCTSTR patchFile, LPCTSTR targetFile);
+VOID InitHashCache ();
+BOOL LoadHashCache (const _TCHAR *cachePath);
+BOOL SaveHashCache (const _TCHAR *cachePath);
+VOID FreeHashCache ();
+BOOL CalculateFileHashCached (TCHAR *path, BYTE *hash);
+VOID StoreFileHash (TCHAR *path, const BYTE *hash);
+
+#define DEFAULT_PATCH_MEMORY_LIMIT	(64 * 1024 * 1024)
+#define PATCH_OVERHEAD				(8 * 1024 * 1024)
+#define PATCH_ERROR_HASH_MISMATCH	-100
+
+//dst[i] += src[i], the step most of a patch's bytes go through
+typedef void (*add_bytes_t)(BYTE *dst, const BYTE *src, size_t len);
+
+#if defined _M_IX86 || defined _M_X64
+#define PATCH_SIMD
+#endif
+
+void add_bytes_scalar(BYTE *dst, const BYTE *src, size_t len);
+#ifdef PATCH_SIMD
+void add_bytes_sse2(BYTE *dst, const BYTE *src, size_t len);
+void add_bytes_avx2(BYTE *dst, const BYTE *src, size_t len);
+#endif
+add_bytes_t select_add_bytes();
+
+BOOL ApplyPatch(LPCTSTR patchFile, LPCTSTR oldFile, LPCTSTR newFile, BYTE *newHash);
+BOOL GetPatchNewSize(LPCTSTR patchFile, LONGLONG *newSize);
+BOOL StartPatchWorkers ();
+BOOL QueuePatch (update_t *update);
+BOOL QueueDownloadedPatches (update_t *updates);
+VOID StopPatchWorkers ();
+BOOL FinishPatchWorkers (update_t *updates);
+
+VOID CreateFoldersForPath (_TCHAR *path);
+BOOL MyCopyFile (_TCHAR *src, _TCHAR *dest);
+BOOL DeleteDirectoryTree (const _TCHAR *path);
+BOOL InstallStaged (update_t *updates, BOOL *fatal);
+
+//Exit code of a Stage run that found nothing to update, Apply then has nothing to do either
+#define EXIT_NOTHING_STAGED		2
+
+BOOL SaveStagePlan (const _TCHAR *path, const BYTE *manifestHash, update_t *updates);
+BOOL LoadStagePlan (const _TCHAR *path, const BYTE *manifestHash, update_t *updates, int *count);
+BOOL VerifyStagePlan (update_t *updates);
+
+typedef struct
+{
+	PTP_POOL			pool;
+	PTP_CLEANUP_GROUP	cleanup;
+	TP_CALLBACK_ENVIRON	env;
+} work_pool_t;
+
+int GetCoreCount ();
+BOOL CreateWorkPool (work_pool_t *pool, int maxThreads);
+VOID QueueWork (work_pool_t *pool, PTP_SIMPLE_CALLBACK callback, VOID *arg);
+VOID FinishWorkPool (work_pool_t *pool);
+
+#define INITIAL_DOWNLOAD_THREADS	2
+#define MAX_DOWNLOAD_THREADS		8
+#define DOWNLOAD_SAMPLE_INTERVAL	2000
+#define MAX_CONNS_PER_HOST			(MAX_DOWNLOAD_THREADS + 1)
+
+//Files at least this big are split into byte ranges that idle workers help fetch
+#define DOWNLOAD_SEGMENT_THRESHOLD	(16 * 1024 * 1024)
+#define DOWNLOAD_SEGMENT_MIN		(2 * 1024 * 1024)
+#define DOWNLOAD_SEGMENT_MAX		(32 * 1024 * 1024)
+#define DOWNLOAD_SEGMENT_TARGET_MS	4000
+
+//Failed files are retried after 1, 2, 4 and 8 seconds, give or take half. A
+//patch that runs out of attempts is downloaded whole instead. The retry budget
+//is shared by the whole run.
+#define DOWNLOAD_MAX_ATTEMPTS		5
+#define DOWNLOAD_RETRY_BASE_MS		1000
+#define DOWNLOAD_RETRY_MAX_MS		8000
+#define DOWNLOAD_RETRY_BUDGET		32
+
+BOOL RunDownloadWorkers (int num, update_t *updates);
+BOOL FallBackToFullDownload (update_t *update);
+
+//Every old file is mapped whole while it's scanned, which bounds the address space we need
+#define DELTA_MIN_SIZE				(1024 * 1024)
+#define DELTA_MAX_OLD_SIZE			(128 * 1024 * 1024)
+#define DELTA_MIN_REUSE_PERCENT		25
+#define DELTA_THREADS				4
+
+VOID RunDeltaSync (update_t *updates);
+
+#define DEFAULT_CACHE_LIMIT	(1024ULL * 1024 * 1024)
+
+BOOL InitDownloadCache (const _TCHAR *dir);
+VOID GetCachePath (const BYTE *hash, const _TCHAR *suffix, _TCHAR *path, size_t size);
+VOID SetCachePath (update_t *update);
+BOOL PublishCachedDownload (update_t *update);
+int __cdecl CompareDownloadHash (const void *a, const void *b);
+int LinkDuplicateDownloads (update_t **items, int count);
+update_t *CompleteDuplicates (update_t *update);
+VOID ReuseCachedDownloads (update_t *updates);
+VOID TouchCacheFile (const _TCHAR *path);
+VOID TouchCachedDownload (update_t *update);
+VOID TrimDownloadCache (ULONGLONG limit);
+
+typedef struct
+{
+	BYTE		hash[20];
+	_TCHAR		*path;
+} local_file_t;
+
+typedef struct
+{
+	local_file_t	*files;
+	int				count;
+	int				allocated;
+} local_index_t;
+
+VOID AddLocalFile (local_index_t *index, const BYTE *hash, const _TCHAR *path);
+VOID ReuseLocalFiles (local_index_t *index, update_t *updates);
+VOID FreeLocalIndex (local_index_t *index);
+
+//Local files are mapped whole while they're chunked
+#define CHUNK_MIN_FILE_SIZE			(256 * 1024)
+#define CHUNK_MAX_LOCAL_SIZE		(128 * 1024 * 1024)
+
+VOID RunChunkSync (local_index_t *index, update_t *updates);
+
+//Files up to this size are fetched together in one request
+#define BATCH_MAX_FILE_SIZE			(256 * 1024)
+#define BATCH_MIN_FILES				8
+
+VOID RunBatchDownload (update_t *updates);
+
+VOID InitThroughputStats ();
+VOID LoadThroughputStats (const _TCHAR *path);
+VOID SaveThroughputStats (const _TCHAR *path);
+VOID RecordDownloadRate (LONGLONG bytes, DWORD ms);
+VOID RecordPatchRate (LONGLONG newSize, DWORD ms);
+BOOL PatchIsCheaper (update_t *update, DWORD patchSize);
+
+VOID Status (const _TCHAR *fmt, ...);
+VOID Log (const _TCHAR *fmt, ...);
 
 extern HWND hwndMain;
 extern HCRYPTPROV hProvider;
-extern int totalFileSize;
-extern int completedFileSize;
+extern volatile LONG totalFileSize;
+extern volatile LONG completedFileSize;
+extern volatile LONG completedUpdates;
+extern BOOL downloadThreadFailure;
 extern HANDLE cancelRequested;
+extern volatile LONGLONG hashedBytes;
+extern DWORD patchMemoryLimit;
 
 #pragma pack(push, r1, 1)
 
@@ -0,0 +1,61 @@
+#include "Updater.h"
+
+int GetCoreCount ()
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo (&info);
+
+	return info.dwNumberOfProcessors ? (int)info.dwNumberOfProcessors : 1;
+}
+
+BOOL CreateWorkPool (work_pool_t *pool, int maxThreads)
+{
+	ZeroMemory (pool, sizeof(*pool));
+
+	pool->pool = CreateThreadpool(NULL);
+	if (!pool->pool)
+		return FALSE;
+
+	SetThreadpoolThreadMaximum (pool->pool, maxThreads);
+	if (!SetThreadpoolThreadMinimum (pool->pool, 1))
+		goto failure;
+
+	pool->cleanup = CreateThreadpoolCleanupGroup();
+	if (!pool->cleanup)
+		goto failure;
+
+	InitializeThreadpoolEnvironment (&pool->env);
+	SetThreadpoolCallbackPool (&pool->env, pool->pool);
+	SetThreadpoolCallbackCleanupGroup (&pool->env, pool->cleanup, NULL);
+
+	return TRUE;
+
+failure:
+	CloseThreadpool (pool->pool);
+	pool->pool = NULL;
+
+	return FALSE;
+}
+
+//Runs the work inline if there is no pool or it can't take any more, so callers don't need a fallback path
+VOID QueueWork (work_pool_t *pool, PTP_SIMPLE_CALLBACK callback, VOID *arg)
+{
+	if (!pool->pool || !TrySubmitThreadpoolCallback(callback, arg, &pool->env))
+		callback (NULL, arg);
+}
+
+VOID FinishWorkPool (work_pool_t *pool)
+{
+	if (!pool->pool)
+		return;
+
+	//Waits for every queued callback to complete
+	CloseThreadpoolCleanupGroupMembers (pool->cleanup, FALSE, NULL);
+	CloseThreadpoolCleanupGroup (pool->cleanup);
+	DestroyThreadpoolEnvironment (&pool->env);
+	CloseThreadpool (pool->pool);
+
+	pool->pool = NULL;
+	pool->cleanup = NULL;
+}
@@ -0,0 +1,293 @@
+#include "../Updater.h"
+
+#include <stdio.h>
+
+//Checks and times the parts of the updater that have more than one way of
+//doing the same thing. Returns non-zero if any of them got something wrong.
+
+#define ADD_TEST_MAX_LENGTH		300
+#define ADD_TEST_MAX_OFFSET		32
+#define ADD_TEST_GUARD			64
+#define ADD_TEST_BUFFER			(ADD_TEST_MAX_OFFSET + ADD_TEST_MAX_LENGTH + ADD_TEST_GUARD)
+
+#define ADD_BENCH_SIZE			(16 * 1024 * 1024)
+#define ADD_BENCH_ROUNDS		32
+
+static DWORD seed = 2463534242u;
+
+static BYTE NextRandom ()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return (BYTE)seed;
+}
+
+static double ElapsedSeconds (LARGE_INTEGER *start)
+{
+	LARGE_INTEGER now, frequency;
+
+	QueryPerformanceCounter (&now);
+	QueryPerformanceFrequency (&frequency);
+
+	return (double)(now.QuadPart - start->QuadPart) / (double)frequency.QuadPart;
+}
+
+//-------------------------------
+// bspatch add step
+//-------------------------------
+
+typedef struct
+{
+	const char	*name;
+	add_bytes_t	add_bytes;
+	BOOL		available;
+} add_kernel_t;
+
+//Every length from empty to well past a few vectors, at every alignment of
+//both buffers, against the scalar version. The guard bytes after the end
+//must come out untouched as well.
+static BOOL CheckAddBytes (add_kernel_t *kernel)
+{
+	BYTE src[ADD_TEST_BUFFER];
+	BYTE original[ADD_TEST_BUFFER];
+	BYTE expected[ADD_TEST_BUFFER];
+	BYTE dst[ADD_TEST_BUFFER];
+
+	for (int length = 0; length <= ADD_TEST_MAX_LENGTH; length++)
+	{
+		for (int i = 0; i < ADD_TEST_BUFFER; i++)
+		{
+			src[i] = NextRandom();
+			original[i] = NextRandom();
+		}
+
+		for (int dstOffset = 0; dstOffset < ADD_TEST_MAX_OFFSET; dstOffset++)
+		{
+			for (int srcOffset = 0; srcOffset < ADD_TEST_MAX_OFFSET; srcOffset++)
+			{
+				memcpy (expected, original, sizeof(expected));
+				memcpy (dst, original, sizeof(dst));
+
+				add_bytes_scalar (expected + dstOffset, src + srcOffset, length);
+				kernel->add_bytes (dst + dstOffset, src + srcOffset, length);
+
+				if (memcmp(dst, expected, sizeof(dst)))
+				{
+					printf ("add_bytes_%s: wrong result for length %d, dst offset %d, src offset %d\n", kernel->name, length, dstOffset, srcOffset);
+					return FALSE;
+				}
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+//MB/s over a buffer much larger than the caches, as a patch would see it
+static double TimeAddBytes (add_kernel_t *kernel, BYTE *dst, const BYTE *src)
+{
+	LARGE_INTEGER start;
+
+	QueryPerformanceCounter (&start);
+
+	for (int i = 0; i < ADD_BENCH_ROUNDS; i++)
+		kernel->add_bytes (dst, src, ADD_BENCH_SIZE);
+
+	return (double)ADD_BENCH_SIZE * ADD_BENCH_ROUNDS / (1024.0 * 1024.0) / ElapsedSeconds(&start);
+}
+
+static int TestAddBytes ()
+{
+	add_bytes_t selected = select_add_bytes();
+	int failed = 0;
+
+	add_kernel_t kernels[] =
+	{
+		{"scalar", add_bytes_scalar, TRUE},
+#ifdef PATCH_SIMD
+		{"sse2", add_bytes_sse2, selected != add_bytes_scalar},
+		{"avx2", add_bytes_avx2, selected == add_bytes_avx2},
+#endif
+	};
+
+	//Odd offsets on purpose, the patch never hands over aligned buffers either
+	BYTE *src = (BYTE *)malloc(ADD_BENCH_SIZE + 1);
+	BYTE *dst = (BYTE *)malloc(ADD_BENCH_SIZE + 3);
+	if (!src || !dst)
+	{
+		printf ("add_bytes: out of memory\n");
+		return 1;
+	}
+
+	for (int i = 0; i < ADD_BENCH_SIZE; i++)
+	{
+		src[i + 1] = NextRandom();
+		dst[i + 3] = NextRandom();
+	}
+
+	for (int i = 0; i < _countof(kernels); i++)
+	{
+		if (!kernels[i].available)
+		{
+			printf ("add_bytes_%s: not supported on this CPU\n", kernels[i].name);
+			continue;
+		}
+
+		if (!CheckAddBytes(&kernels[i]))
+		{
+			failed++;
+			continue;
+		}
+
+		printf ("add_bytes_%s: ok, %.0f MB/s%s\n", kernels[i].name, TimeAddBytes(&kernels[i], dst + 3, src + 1),
+			kernels[i].add_bytes == selected ? " (selected)" : "");
+	}
+
+	free (src);
+	free (dst);
+
+	return failed;
+}
+
+//-------------------------------
+// Update index
+//-------------------------------
+
+#define INDEX_TEST_PACKAGES		40
+#define INDEX_TEST_FILES		250
+#define INDEX_BENCH_ROUNDS		20
+
+//What the patch manifest loop did before the index, the first match in list order
+static update_t *FindUpdateInList (update_t *updates, const char *packageName, const _TCHAR *basename)
+{
+	for (update_t *update = updates->next; update; update = update->next)
+	{
+		if (!strcmp(update->packageName, packageName) && !_tcscmp(update->basename, basename))
+			return update;
+	}
+
+	return NULL;
+}
+
+static update_t *AddTestUpdate (update_t *last, const char *packageName, const _TCHAR *basename)
+{
+	update_t *update = (update_t *)calloc(1, sizeof(*update));
+	if (!update)
+		return NULL;
+
+	update->packageName = _strdup(packageName);
+	update->basename = _tcsdup(basename);
+	last->next = update;
+
+	return update;
+}
+
+//Every key, a repeated key and keys that aren't there must find what a list
+//scan finds, then both are timed over the whole list as a patch manifest
+//listing every file would look them up
+static int TestUpdateIndex ()
+{
+	update_t updates = {0};
+	update_t *last = &updates;
+	update_index_t index = {0};
+	char packageName[32];
+	_TCHAR basename[MAX_PATH];
+	LARGE_INTEGER start;
+	double indexTime, listTime;
+	int count = 0;
+	int found = 0;
+	int failed = 0;
+
+	for (int p = 0; p < INDEX_TEST_PACKAGES && last; p++)
+	{
+		StringCbPrintfA(packageName, sizeof(packageName), "package%d", p);
+
+		for (int i = 0; i < INDEX_TEST_FILES && last; i++)
+		{
+			StringCbPrintf(basename, sizeof(basename), _T("bin\\64bit\\file%d.dll"), i);
+			last = AddTestUpdate(last, packageName, basename);
+			count++;
+		}
+	}
+
+	//Same key twice, the index has to keep the first one like the list scan does
+	if (last)
+		last = AddTestUpdate(last, "package0", _T("bin\\64bit\\file0.dll"));
+
+	if (!last || !BuildUpdateIndex(&index, &updates, count + 1))
+	{
+		printf ("update index: out of memory\n");
+		failed++;
+		goto failure;
+	}
+
+	for (update_t *update = updates.next; update; update = update->next)
+	{
+		if (FindUpdate(&index, update->packageName, update->basename) != FindUpdateInList(&updates, update->packageName, update->basename))
+		{
+			printf ("update index: wrong update for %s/%S\n", update->packageName, update->basename);
+			failed++;
+			goto failure;
+		}
+	}
+
+	if (FindUpdate(&index, "package0", _T("missing.dll")) || FindUpdate(&index, "missing", _T("bin\\64bit\\file0.dll")))
+	{
+		printf ("update index: found an update that isn't there\n");
+		failed++;
+		goto failure;
+	}
+
+	QueryPerformanceCounter (&start);
+
+	for (int round = 0; round < INDEX_BENCH_ROUNDS; round++)
+	{
+		for (update_t *update = updates.next; update; update = update->next)
+			found += FindUpdate(&index, update->packageName, update->basename) != NULL;
+	}
+
+	indexTime = ElapsedSeconds(&start) / INDEX_BENCH_ROUNDS;
+
+	QueryPerformanceCounter (&start);
+
+	for (update_t *update = updates.next; update; update = update->next)
+		found += FindUpdateInList(&updates, update->packageName, update->basename) != NULL;
+
+	listTime = ElapsedSeconds(&start);
+
+	printf ("update index: ok, %d lookups in %d files, %.3f ms indexed, %.3f ms list scan\n",
+		count + 1, count + 1, indexTime * 1000.0, listTime * 1000.0);
+
+	if (found != (count + 1) * (INDEX_BENCH_ROUNDS + 1))
+		failed++;
+
+failure:
+	FreeUpdateIndex (&index);
+
+	while (updates.next)
+	{
+		update_t *update = updates.next;
+
+		updates.next = update->next;
+		free (update->packageName);
+		free (update->basename);
+		free (update);
+	}
+
+	return failed;
+}
+
+int main ()
+{
+	int failed = 0;
+
+	failed += TestAddBytes();
+	failed += TestUpdateIndex();
+
+	if (failed)
+		printf ("%d checks failed\n", failed);
+
+	return failed ? 1 : 0;
+}